@@ -17,29 +17,220 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <netdb.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
 #include <linux/vm_sockets.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-static int parse_cid(const char *cid_str)
+#include "vsock-transport.h"
+
+/* Default size of each direction's ring buffer, also caps the splice pipe */
+#define RELAY_BUF_SIZE (64 * 1024)
+
+/* Relay buffers this large are mmapped and backed by huge pages if possible */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Writes smaller than this are copied even with --zerocopy */
+#define ZEROCOPY_MIN (16 * 1024)
+
+/*
+ * Gateway (-G) limits, how long a client has to send its header line, and
+ * the guest to accept the session and take what followed the header
+ */
+#define GATEWAY_MAX_LISTENERS 16
+#define GATEWAY_MAX_ROUTES 64
+#define GATEWAY_HEADER_MAX 128
+#define GATEWAY_HEADER_TIMEOUT_SEC 5
+#define GATEWAY_CONNECT_TIMEOUT_SEC 5
+
+/* Zerocopy sends a direction can have awaiting completion */
+#define ZC_QUEUE_LEN 64
+
+/*
+ * A MSG_ZEROCOPY send whose ring bytes [start, end) the kernel may still be
+ * reading, until the completion for seq arrives on the error queue.
+ */
+struct zc_send {
+	uint32_t seq;
+	bool done;
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * Counters for one direction (to or from the remote) of the relays run by
+ * one thread.  Only that thread writes them, the stats thread sums them up
+ * for --stats-interval/SIGUSR1 dumps, so updates are plain relaxed stores.
+ */
+struct dir_stats {
+	uint64_t bytes;		/* written to out_fd */
+	uint64_t reads;		/* read/splice calls */
+	uint64_t writes;	/* write/splice calls */
+	uint64_t short_writes;	/* wrote less than was pending */
+	uint64_t read_eagain;	/* nothing to read, the normal idle case */
+	uint64_t write_eagain;	/* out_fd full */
+	uint64_t stall_ticks;	/* from a write EAGAIN until writing resumed */
+};
+
+struct zc_stats {
+	unsigned long long sends;	/* sent with MSG_ZEROCOPY */
+	unsigned long long completions;
+	unsigned long long copied;	/* completed, but the kernel copied anyway */
+	unsigned long long small;	/* below --zerocopy-min, copied */
+	unsigned long long fallbacks;	/* queue full or ENOBUFS, copied */
+};
+
+/*
+ * One direction of a relay, in_fd -> out_fd.  Data that has been read but
+ * not yet written sits either in the ring buffer or, when splicing, in the
+ * intermediate pipe.  rd_off/wr_off count the bytes that have gone through
+ * the ring so far and are reduced modulo buf_size to index it.
+ */
+struct relay_dir {
+	int in_fd;
+	int out_fd;
+	bool eof;		/* in_fd returned end-of-file */
+
+	char *buf;
+	size_t buf_size;
+	uint64_t rd_off;	/* bytes read from in_fd into buf */
+	uint64_t wr_off;	/* bytes written from buf to out_fd */
+
+	bool msg_in;		/* in_fd keeps message boundaries (seqpacket) */
+	bool msg_out;		/* so does out_fd */
+
+	bool use_splice;
+	int pipe_fds[2];	/* intermediate pipe for splice(), -1 if unused */
+	size_t pipe_size;	/* pipe capacity */
+	size_t pipe_bytes;	/* bytes currently held in the pipe */
+
+	struct dir_stats *stats;
+	uint64_t stall_start;	/* stats_ticks() at the first write EAGAIN, or 0 */
+
+	/*
+	 * With --zerocopy, ring bytes stay in use after being written until
+	 * their completion arrives, so reads only refill up to the oldest
+	 * send still queued here.
+	 */
+	bool zerocopy;		/* SO_ZEROCOPY is on for out_fd */
+	uint32_t zc_seq;	/* the kernel's id for our next zerocopy send */
+	struct zc_send zc_queue[ZC_QUEUE_LEN];
+	unsigned int zc_head;	/* oldest entry */
+	unsigned int zc_count;
+	struct zc_stats zc_stats;
+};
+
+/*
+ * A file descriptor taking part in a relay.  Sockets are both read by one
+ * direction and written by the other, stdin/stdout only by one of them.
+ */
+struct relay_fd {
+	int fd;
+	struct relay *relay;
+	struct relay_dir *reader;	/* direction reading from fd, or NULL */
+	struct relay_dir *writer;	/* direction writing to fd, or NULL */
+	bool pollable;		/* false for regular files, which epoll rejects */
+	uint32_t events;	/* events registered with epoll, 0 if not added */
+};
+
+struct relay {
+	struct relay_dir dirs[2];
+	struct relay_fd fds[3];
+	int nfds;
+	bool done;
+};
+
+/*
+ * Gateway routing table: sessions accepted on a -G port whose number is a
+ * key go straight to that destination, on other -G ports the first line
+ * the client sends names the key.
+ */
+struct route {
+	const char *key;
+	unsigned int cid;
+	unsigned int port;
+};
+
+enum engine {
+	ENGINE_EPOLL,
+	ENGINE_IO_URING,
+};
+
+static bool opt_splice;
+static enum engine opt_engine = ENGINE_EPOLL;
+static bool opt_keep_listening;
+static int opt_workers;
+static int opt_pool;
+static const char *opt_listen_port;
+static const char *opt_tcp_dst;
+static const char *opt_tcp_dstport;
+static const char *opt_cid;
+static const char *opt_port;
+static size_t opt_buf_size = RELAY_BUF_SIZE;
+static unsigned long long opt_vsock_buf_size;
+static unsigned long long opt_vsock_buf_max;
+static int opt_tcp_sndbuf;
+static int opt_tcp_rcvbuf;
+static bool opt_zerocopy;
+static unsigned long long opt_zerocopy_min = ZEROCOPY_MIN;
+static bool opt_duplex;
+static int opt_duplex_cpus[2] = { -1, -1 };
+static const char *opt_gateways[GATEWAY_MAX_LISTENERS];
+static int opt_ngateways;
+static struct route opt_routes[GATEWAY_MAX_ROUTES];
+static int opt_nroutes;
+static bool opt_stats;		/* any of --stats, --stats-interval, --stats-fd */
+static double opt_stats_interval;
+static int opt_stats_fd = STDERR_FILENO;
+
+/* The single session's counters, see struct worker for -k */
+static struct dir_stats session_stats[2];
+
+static const char *const dir_names[2] = { "to_remote", "from_remote" };
+
+static inline void stat_add(uint64_t *counter, uint64_t n)
 {
-	char *end = NULL;
-	long cid = strtol(cid_str, &end, 10);
-	if (cid_str != end && *end == '\0') {
-		return cid;
-	} else {
-		fprintf(stderr, "invalid cid: %s\n", cid_str);
-		return -1;
-	}
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* A timestamp for stall times, the TSC where there is one */
+static inline uint64_t stats_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
 static int parse_port(const char *port_str)
@@ -54,70 +245,174 @@ static int parse_port(const char *port_str)
 	}
 }
 
-static int vsock_listen(const char *port_str)
+/* Parse a byte count with an optional K, M or G (binary) suffix */
+static int parse_size(const char *size_str, unsigned long long *size)
 {
-	int listen_fd;
-	int client_fd;
-	struct sockaddr_vm sa_listen = {
-		.svm_family = AF_VSOCK,
-		.svm_cid = VMADDR_CID_ANY,
-	};
-	struct sockaddr_vm sa_client;
-	socklen_t socklen_client = sizeof(sa_client);
-	int port = parse_port(port_str);
-	if (port < 0) {
-		return -1;
+	char *end = NULL;
+	unsigned long long val = strtoull(size_str, &end, 10);
+	int shift = 0;
+
+	if (size_str == end) {
+		goto invalid;
 	}
 
-	sa_listen.svm_port = port;
+	switch (*end) {
+	case 'k': case 'K': shift = 10; end++; break;
+	case 'm': case 'M': shift = 20; end++; break;
+	case 'g': case 'G': shift = 30; end++; break;
+	}
 
-	listen_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
-		return -1;
+	if (*end != '\0' || val == 0 || val > (ULLONG_MAX >> shift)) {
+		goto invalid;
 	}
 
-	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
-		perror("bind");
-		close(listen_fd);
-		return -1;
+	*size = val << shift;
+	return 0;
+
+invalid:
+	fprintf(stderr, "invalid size: %s\n", size_str);
+	return -1;
+}
+
+/*
+ * Apply --vsock-buf-size/--vsock-buf-max.  The kernel clamps the buffer size
+ * to the configured maximum, so the maximum has to go first.  Listening
+ * sockets pass these on to the connections they accept.
+ */
+static void vsock_set_buffer_size(int fd)
+{
+	static bool reported;
+	unsigned long long max = opt_vsock_buf_max;
+	unsigned long long size = opt_vsock_buf_size;
+	socklen_t len = sizeof(size);
+
+	if (!max && !size) {
+		return;
 	}
 
-	if (listen(listen_fd, 1) != 0) {
-		perror("listen");
-		close(listen_fd);
-		return -1;
+	if (!max && size) {
+		max = size;
 	}
 
-	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
-	if (client_fd < 0) {
-		perror("accept");
-		close(listen_fd);
+	if (setsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE, &max, sizeof(max)) != 0) {
+		perror("setsockopt SO_VM_SOCKETS_BUFFER_MAX_SIZE");
+	}
+	if (size && setsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &size, sizeof(size)) != 0) {
+		perror("setsockopt SO_VM_SOCKETS_BUFFER_SIZE");
+	}
+
+	if (reported) {
+		return;
+	}
+	reported = true;
+
+	len = sizeof(size);
+	if (getsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &size, &len) != 0) {
+		perror("getsockopt SO_VM_SOCKETS_BUFFER_SIZE");
+		return;
+	}
+	len = sizeof(max);
+	if (getsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE, &max, &len) != 0) {
+		perror("getsockopt SO_VM_SOCKETS_BUFFER_MAX_SIZE");
+		return;
+	}
+	fprintf(stderr, "vsock buffer size %llu (max %llu)\n", size, max);
+}
+
+/* Apply --tcp-sndbuf/--tcp-rcvbuf, before connect() so window scaling fits */
+static void tcp_set_buffer_size(int fd)
+{
+	static bool reported;
+	int sndbuf;
+	int rcvbuf;
+	socklen_t len;
+
+	if (!opt_tcp_sndbuf && !opt_tcp_rcvbuf) {
+		return;
+	}
+
+	if (opt_tcp_sndbuf &&
+	    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt_tcp_sndbuf, sizeof(opt_tcp_sndbuf)) != 0) {
+		perror("setsockopt SO_SNDBUF");
+	}
+	if (opt_tcp_rcvbuf &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt_tcp_rcvbuf, sizeof(opt_tcp_rcvbuf)) != 0) {
+		perror("setsockopt SO_RCVBUF");
+	}
+
+	if (reported) {
+		return;
+	}
+	reported = true;
+
+	/* Linux reports double the requested value to account for overhead */
+	len = sizeof(sndbuf);
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0) {
+		perror("getsockopt SO_SNDBUF");
+		return;
+	}
+	len = sizeof(rcvbuf);
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) != 0) {
+		perror("getsockopt SO_RCVBUF");
+		return;
+	}
+	fprintf(stderr, "tcp sndbuf %d rcvbuf %d\n", sndbuf, rcvbuf);
+}
+
+static int vsock_listen_fd(const char *port_str, int backlog)
+{
+	int port = parse_port(port_str);
+
+	if (port < 0) {
 		return -1;
 	}
+	return vsock_listen_port(port, backlog);
+}
+
+static int vsock_accept(int listen_fd)
+{
+	struct peer_id peer;
+
+	return vsock_transport.accept(listen_fd, &peer);
+}
+
+static int vsock_listen(const char *port_str)
+{
+	int listen_fd;
+	int client_fd;
 
-	fprintf(stderr, "Connection from cid %u port %u...\n", sa_client.svm_cid, sa_client.svm_port);
+	listen_fd = vsock_listen_fd(port_str, 1);
+	if (listen_fd < 0) {
+		return -1;
+	}
 
+	client_fd = vsock_accept(listen_fd);
 	close(listen_fd);
 	return client_fd;
 }
 
-static int tcp_connect(const char *node, const char *service)
+/* family is AF_INET for -t destinations, AF_UNSPEC for -G listen addresses */
+static struct addrinfo *tcp_resolve(const char *node, const char *service, int family)
 {
-	int fd = -1;
 	int ret;
 	const struct addrinfo hints = {
-		.ai_family = AF_INET,
+		.ai_family = family,
 		.ai_socktype = SOCK_STREAM,
 	};
 	struct addrinfo *res = NULL;
-	struct addrinfo *addrinfo;
 
 	ret = getaddrinfo(node, service, &hints, &res);
 	if (ret != 0) {
 		fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret));
-		return -1;
+		return NULL;
 	}
+	return res;
+}
+
+static int tcp_connect_addrinfo(const struct addrinfo *res)
+{
+	int fd = -1;
+	const struct addrinfo *addrinfo;
 
 	for (addrinfo = res; addrinfo; addrinfo = addrinfo->ai_next) {
 		fd = socket(addrinfo->ai_family, addrinfo->ai_socktype, addrinfo->ai_protocol);
@@ -126,66 +421,400 @@ static int tcp_connect(const char *node, const char *service)
 			continue;
 		}
 
+		tcp_set_buffer_size(fd);
+
 		if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) != 0) {
 			perror("connect");
 			close(fd);
+			fd = -1;
 			continue;
 		}
 
 		break;
 	}
 
+	return fd;
+}
+
+static int tcp_connect(const char *node, const char *service)
+{
+	struct addrinfo *res = tcp_resolve(node, service, AF_INET);
+	int fd;
+
+	if (!res) {
+		return -1;
+	}
+
+	fd = tcp_connect_addrinfo(res);
 	freeaddrinfo(res);
 	return fd;
 }
 
 static int vsock_connect(const char *cid_str, const char *port_str)
 {
-	int fd;
+	int cid = parse_cid(cid_str);
+	int port = parse_port(port_str);
+
+	if (cid < 0 || port < 0) {
+		return -1;
+	}
+	return vsock_connect_port(cid, port, 0);
+}
+
+/* Parse "<cpu>" (both duplex threads) or "<cpu>,<cpu>" */
+static int parse_duplex_cpus(const char *cpus_str)
+{
+	char *end = NULL;
+
+	for (int i = 0; i < 2; i++) {
+		long cpu = strtol(cpus_str, &end, 10);
+
+		if (end == cpus_str || cpu < 0 || cpu >= CPU_SETSIZE) {
+			return -1;
+		}
+		opt_duplex_cpus[i] = cpu;
+		if (*end == '\0') {
+			if (i == 0) {
+				opt_duplex_cpus[1] = cpu;
+			}
+			return 0;
+		}
+		if (*end != ',') {
+			return -1;
+		}
+		cpus_str = end + 1;
+	}
+	return -1;
+}
+
+/* Parse "<key>=<cid>:<port>" into the routing table */
+static int parse_route(char *route_str)
+{
+	struct route *route = &opt_routes[opt_nroutes];
+	char *eq = strchr(route_str, '=');
+	char *colon = eq ? strchr(eq + 1, ':') : NULL;
 	int cid;
 	int port;
-	struct sockaddr_vm sa = {
-		.svm_family = AF_VSOCK,
+
+	if (!colon || eq == route_str || opt_nroutes == GATEWAY_MAX_ROUTES) {
+		return -1;
+	}
+	*eq = '\0';
+	*colon = '\0';
+
+	cid = parse_cid(eq + 1);
+	port = parse_port(colon + 1);
+	if (cid < 0 || port < 0) {
+		return -1;
+	}
+
+	route->key = route_str;
+	route->cid = cid;
+	route->port = port;
+	opt_nroutes++;
+	return 0;
+}
+
+/* Long options without a short equivalent */
+enum {
+	OPT_VSOCK_BUF_SIZE = 256,
+	OPT_VSOCK_BUF_MAX,
+	OPT_TCP_SNDBUF,
+	OPT_TCP_RCVBUF,
+	OPT_SOCK_TYPE,
+	OPT_ZEROCOPY,
+	OPT_ZEROCOPY_MIN,
+	OPT_DUPLEX_CPUS,
+	OPT_STATS,
+	OPT_STATS_INTERVAL,
+	OPT_STATS_FD,
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options] [-l <port> [-t <dst> <dstport>] | <cid> <port>]\n"
+			"  -S, --splice          relay via splice(2) through a pipe where the fds allow it\n"
+			"  -k, --keep-listening  with -l/-t, keep accepting vsock connections and give\n"
+			"                        each its own TCP connection to <dst> <dstport>\n"
+			"  -W, --workers <n>     relay threads for -k and -G (default: number of CPUs)\n"
+			"  -P, --pool <n>        with -k, keep <n> TCP connections to <dst> open ahead\n"
+			"                        of time\n"
+			"  -E, --engine <epoll|io_uring>\n"
+			"                        relay engine for a single session (default: epoll),\n"
+			"                        io_uring falls back to epoll if unavailable\n"
+			"  -G, --gateway [<addr>:]<port>\n"
+			"                        TCP -> vsock gateway: listen on TCP <port> (on\n"
+			"                        127.0.0.1 by default, may be repeated, IPv6 as\n"
+			"                        [<addr>]:<port>) and relay each session to the\n"
+			"                        destination -R gives for it\n"
+			"  -R, --route <key>=<cid>:<port>\n"
+			"                        gateway routing table entry, the key is a -G port\n"
+			"                        number or the first line sent on a -G port that has\n"
+			"                        none\n"
+			"  -D, --duplex          relay each direction of a single session on its own\n"
+			"                        thread, passing EOF on with shutdown(SHUT_WR)\n"
+			"  --duplex-cpus <cpu>[,<cpu>]\n"
+			"                        pin the -D threads (to the remote, from it)\n"
+			"  -B, --buffer-size <bytes>\n"
+			"                        relay buffer per direction (default: 64K), huge page\n"
+			"                        backed from 2M up\n"
+			"  --vsock-buf-size <bytes>, --vsock-buf-max <bytes>\n"
+			"                        SO_VM_SOCKETS_BUFFER_SIZE/_MAX_SIZE for vsock sockets\n"
+			"  --tcp-sndbuf <bytes>, --tcp-rcvbuf <bytes>\n"
+			"                        SO_SNDBUF/SO_RCVBUF for the -t connection\n"
+			"  --sock-type <stream|seqpacket>\n"
+			"                        vsock socket type (default: stream), seqpacket relays\n"
+			"                        each message whole, up to the -B buffer size\n"
+			"                        (zero-length messages are dropped)\n"
+			"  --zerocopy            send to sockets with MSG_ZEROCOPY, reporting\n"
+			"                        completion and fallback counts at the end\n"
+			"  --zerocopy-min <bytes>\n"
+			"                        copy writes smaller than this (default: 16K)\n"
+			"  --stats               print per-direction counters as a JSON line on SIGUSR1\n"
+			"  --stats-interval <seconds>\n"
+			"                        also print them this often (implies --stats)\n"
+			"  --stats-fd <fd>       where the counters go (default: 2, stderr, implies\n"
+			"                        --stats)\n"
+			"  sizes take an optional K, M or G suffix\n",
+			argv0);
+}
+
+static int parse_args(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "splice", no_argument, NULL, 'S' },
+		{ "keep-listening", no_argument, NULL, 'k' },
+		{ "workers", required_argument, NULL, 'W' },
+		{ "pool", required_argument, NULL, 'P' },
+		{ "engine", required_argument, NULL, 'E' },
+		{ "duplex", no_argument, NULL, 'D' },
+		{ "gateway", required_argument, NULL, 'G' },
+		{ "route", required_argument, NULL, 'R' },
+		{ "duplex-cpus", required_argument, NULL, OPT_DUPLEX_CPUS },
+		{ "stats", no_argument, NULL, OPT_STATS },
+		{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+		{ "stats-fd", required_argument, NULL, OPT_STATS_FD },
+		{ "buffer-size", required_argument, NULL, 'B' },
+		{ "vsock-buf-size", required_argument, NULL, OPT_VSOCK_BUF_SIZE },
+		{ "vsock-buf-max", required_argument, NULL, OPT_VSOCK_BUF_MAX },
+		{ "tcp-sndbuf", required_argument, NULL, OPT_TCP_SNDBUF },
+		{ "tcp-rcvbuf", required_argument, NULL, OPT_TCP_RCVBUF },
+		{ "sock-type", required_argument, NULL, OPT_SOCK_TYPE },
+		{ "zerocopy", no_argument, NULL, OPT_ZEROCOPY },
+		{ "zerocopy-min", required_argument, NULL, OPT_ZEROCOPY_MIN },
+		{ NULL, 0, NULL, 0 },
 	};
+	unsigned long long size;
+	char *end;
+	int opt;
+
+	/* '+' stops at the first non-option so <cid> <port> stay positional */
+	while ((opt = getopt_long(argc, argv, "+SkW:P:E:DG:R:B:l:t:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'S':
+			opt_splice = true;
+			break;
+		case 'k':
+			opt_keep_listening = true;
+			break;
+		case 'W':
+			opt_workers = atoi(optarg);
+			if (opt_workers <= 0) {
+				fprintf(stderr, "invalid number of workers: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'P':
+			opt_pool = atoi(optarg);
+			if (opt_pool <= 0) {
+				fprintf(stderr, "invalid pool size: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'E':
+			if (strcmp(optarg, "epoll") == 0) {
+				opt_engine = ENGINE_EPOLL;
+			} else if (strcmp(optarg, "io_uring") == 0) {
+				opt_engine = ENGINE_IO_URING;
+			} else {
+				fprintf(stderr, "invalid engine: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'D':
+			opt_duplex = true;
+			break;
+		case 'G':
+			if (opt_ngateways == GATEWAY_MAX_LISTENERS) {
+				fprintf(stderr, "too many gateway ports\n");
+				return -1;
+			}
+			opt_gateways[opt_ngateways++] = optarg;
+			break;
+		case 'R':
+			if (parse_route(optarg) < 0) {
+				fprintf(stderr, "invalid route: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_DUPLEX_CPUS:
+			if (parse_duplex_cpus(optarg) < 0) {
+				fprintf(stderr, "invalid duplex cpus: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_STATS:
+			opt_stats = true;
+			break;
+		case OPT_STATS_INTERVAL:
+			opt_stats_interval = strtod(optarg, &end);
+			if (*end != '\0' || opt_stats_interval <= 0) {
+				fprintf(stderr, "invalid stats interval: %s\n", optarg);
+				return -1;
+			}
+			opt_stats = true;
+			break;
+		case OPT_STATS_FD:
+			opt_stats_fd = strtol(optarg, &end, 10);
+			if (*end != '\0' || opt_stats_fd < 0 || fcntl(opt_stats_fd, F_GETFD) < 0) {
+				fprintf(stderr, "invalid stats fd: %s\n", optarg);
+				return -1;
+			}
+			opt_stats = true;
+			break;
+		case 'B':
+			if (parse_size(optarg, &size) < 0) {
+				return -1;
+			}
+			opt_buf_size = size;
+			break;
+		case OPT_VSOCK_BUF_SIZE:
+			if (parse_size(optarg, &opt_vsock_buf_size) < 0) {
+				return -1;
+			}
+			break;
+		case OPT_VSOCK_BUF_MAX:
+			if (parse_size(optarg, &opt_vsock_buf_max) < 0) {
+				return -1;
+			}
+			break;
+		case OPT_TCP_SNDBUF:
+		case OPT_TCP_RCVBUF:
+			if (parse_size(optarg, &size) < 0) {
+				return -1;
+			}
+			if (size > INT_MAX) {
+				fprintf(stderr, "socket buffer size too large: %s\n", optarg);
+				return -1;
+			}
+			if (opt == OPT_TCP_SNDBUF) {
+				opt_tcp_sndbuf = size;
+			} else {
+				opt_tcp_rcvbuf = size;
+			}
+			break;
+		case OPT_SOCK_TYPE:
+			if (parse_sock_type(optarg) < 0) {
+				fprintf(stderr, "invalid socket type: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_ZEROCOPY:
+			opt_zerocopy = true;
+			break;
+		case OPT_ZEROCOPY_MIN:
+			if (parse_size(optarg, &opt_zerocopy_min) < 0) {
+				return -1;
+			}
+			break;
+		case 'l':
+			opt_listen_port = optarg;
+			break;
+		case 't':
+			/* -t takes two arguments, the second is picked up here */
+			if (optind >= argc) {
+				return -1;
+			}
+			opt_tcp_dst = optarg;
+			opt_tcp_dstport = argv[optind++];
+			break;
+		default:
+			return -1;
+		}
+	}
 
-	cid = parse_cid(cid_str);
-	if (cid < 0) {
+	if (opt_ngateways > 0) {
+		if (optind != argc || opt_listen_port || opt_keep_listening ||
+		    opt_duplex || opt_engine == ENGINE_IO_URING) {
+			fprintf(stderr, "-G takes no <cid> <port> and is not supported with -l, -k, -D or -E io_uring\n");
+			return -1;
+		}
+		if (opt_nroutes == 0) {
+			fprintf(stderr, "-G requires at least one -R route\n");
+			return -1;
+		}
+	} else if (opt_nroutes > 0) {
+		fprintf(stderr, "-R requires -G\n");
+		return -1;
+	} else if (opt_listen_port) {
+		if (optind != argc) {
+			return -1;
+		}
+	} else if (opt_tcp_dst || argc - optind != 2) {
 		return -1;
+	} else {
+		opt_cid = argv[optind];
+		opt_port = argv[optind + 1];
 	}
-	sa.svm_cid = cid;
 
-	port = parse_port(port_str);
-	if (port < 0) {
+	if (opt_keep_listening && !opt_tcp_dst) {
+		fprintf(stderr, "-k requires -l <port> -t <dst> <dstport>\n");
 		return -1;
 	}
-	sa.svm_port = port;
 
-	fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (fd < 0) {
-		perror("socket");
+	if (opt_pool && !opt_keep_listening) {
+		fprintf(stderr, "-P requires -k\n");
 		return -1;
 	}
 
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-		perror("connect");
-		close(fd);
+	if (opt_engine == ENGINE_IO_URING && (opt_keep_listening || opt_splice)) {
+		fprintf(stderr, "-E io_uring is not supported with -k or -S\n");
 		return -1;
 	}
 
-	return fd;
+	if (opt_engine == ENGINE_IO_URING && sock_type != SOCK_STREAM) {
+		fprintf(stderr, "-E io_uring is not supported with --sock-type seqpacket\n");
+		return -1;
+	}
+
+	if (opt_duplex && (opt_keep_listening || opt_engine == ENGINE_IO_URING)) {
+		fprintf(stderr, "-D is not supported with -k or -E io_uring\n");
+		return -1;
+	}
+
+	if (opt_duplex_cpus[0] >= 0 && !opt_duplex) {
+		fprintf(stderr, "--duplex-cpus requires -D\n");
+		return -1;
+	}
+
+	if (opt_zerocopy && (opt_engine == ENGINE_IO_URING || opt_splice)) {
+		fprintf(stderr, "--zerocopy is not supported with -E io_uring or -S\n");
+		return -1;
+	}
+	return 0;
 }
 
-static int get_remote_fd(int argc, char **argv)
+static int get_remote_fd(void)
 {
-	if (argc >= 3 && strcmp(argv[1], "-l") == 0) {
-		int remote_fd = vsock_listen(argv[2]);
+	if (opt_listen_port) {
+		int remote_fd = vsock_listen(opt_listen_port);
 
 		if (remote_fd < 0) {
 			return -1;
 		}
 
-		if (argc == 6 && strcmp(argv[3], "-t") == 0) {
-			int fd = tcp_connect(argv[4], argv[5]);
+		if (opt_tcp_dst) {
+			int fd = tcp_connect(opt_tcp_dst, opt_tcp_dstport);
 			if (fd < 0) {
 				return -1;
 			}
@@ -199,11 +828,8 @@ static int get_remote_fd(int argc, char **argv)
 			}
 		}
 		return remote_fd;
-	} else if (argc == 3) {
-		return vsock_connect(argv[1], argv[2]);
 	} else {
-		fprintf(stderr, "usage: %s [-l <port> [-t <dst> <dstport>] | <cid> <port>]\n", argv[0]);
-		return -1;
+		return vsock_connect(opt_cid, opt_port);
 	}
 }
 
@@ -226,95 +852,2296 @@ static void set_nonblock(int fd, bool enable)
 	fcntl(fd, F_SETFL, flags);
 }
 
-static int xfer_data(int in_fd, int out_fd)
+static size_t relay_dir_pending(const struct relay_dir *dir)
 {
-	char buf[4096];
-	char *send_ptr = buf;
-	ssize_t nbytes;
-	ssize_t remaining;
-
-	nbytes = read(in_fd, buf, sizeof(buf));
-	if (nbytes <= 0) {
-		return -1;
+	if (dir->use_splice) {
+		return dir->pipe_bytes;
 	}
+	return dir->rd_off - dir->wr_off;
+}
 
-	remaining = nbytes;
-	while (remaining > 0) {
-		nbytes = write(out_fd, send_ptr, remaining);
-		if (nbytes < 0 && errno == EAGAIN) {
-			nbytes = 0;
-		} else if (nbytes <= 0) {
-			return -1;
-		}
-
-		if (remaining > nbytes) {
-			/* Wait for fd to become writeable again */
-			for (;;) {
-				fd_set wfds;
-				FD_ZERO(&wfds);
-				FD_SET(out_fd, &wfds);
-				if (select(out_fd + 1, NULL, &wfds, NULL, NULL) < 0) {
-					if (errno == EINTR) {
-						continue;
-					} else {
-						perror("select");
-						return -1;
-					}
-				}
-
-				if (FD_ISSET(out_fd, &wfds)) {
-					break;
-				}
-			}
-		}
+/* Ring bytes before this offset can be reused, see struct relay_dir */
+static uint64_t relay_dir_released(const struct relay_dir *dir)
+{
+	if (dir->zc_count > 0) {
+		return dir->zc_queue[dir->zc_head].start;
+	}
+	return dir->wr_off;
+}
 
-		send_ptr += nbytes;
-		remaining -= nbytes;
+static bool relay_dir_wants_read(const struct relay_dir *dir)
+{
+	if (dir->eof) {
+		return false;
 	}
-	return 0;
+	if (dir->use_splice) {
+		return dir->pipe_bytes < dir->pipe_size;
+	}
+	if (dir->msg_in) {
+		/* one whole message at a time, see relay_dir_fill() */
+		return dir->rd_off == relay_dir_released(dir);
+	}
+	return dir->rd_off - relay_dir_released(dir) < dir->buf_size;
 }
 
-static void main_loop(int remote_fd)
+static bool fd_is_socket(int fd)
 {
-	fd_set rfds;
-	int nfds = remote_fd + 1;
+	int type;
+	socklen_t len = sizeof(type);
 
-	set_nonblock(STDIN_FILENO, true);
-	set_nonblock(STDOUT_FILENO, true);
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0;
+}
+
+/* eg: stdin and stdout after -t dup2()s the connection to both */
+static bool fds_same_file(int fd1, int fd2)
+{
+	struct stat st1, st2;
+
+	return fstat(fd1, &st1) == 0 && fstat(fd2, &st2) == 0 &&
+	       st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+}
+
+static bool fd_is_seqpacket(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+	       type == SOCK_SEQPACKET;
+}
+
+static size_t relay_buf_map_size(size_t size)
+{
+	return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Large relay buffers are mmapped so they can use huge pages: explicit
+ * hugetlbfs pages if any are reserved, else transparent huge pages.
+ */
+static void *relay_buf_alloc(size_t size)
+{
+	static bool reported;
+	const char *backing = "heap";
+	void *buf;
+
+	if (size < HUGE_PAGE_SIZE) {
+		/* page aligned so MSG_ZEROCOPY pins only the ring's own pages */
+		int ret = posix_memalign(&buf, sysconf(_SC_PAGESIZE), size);
+		if (ret != 0) {
+			errno = ret;
+			perror("posix_memalign");
+			buf = NULL;
+		}
+	} else {
+		size_t map_size = relay_buf_map_size(size);
+
+		backing = "hugetlb";
+		buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED) {
+			buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buf == MAP_FAILED) {
+				perror("mmap");
+				return NULL;
+			}
+			backing = madvise(buf, map_size, MADV_HUGEPAGE) == 0 ? "thp" : "mmap";
+		}
+	}
+
+	if (buf && !reported && opt_buf_size != RELAY_BUF_SIZE) {
+		reported = true;
+		fprintf(stderr, "relay buffer size %zu (%s)\n", size, backing);
+	}
+	return buf;
+}
+
+static void relay_buf_free(void *buf, size_t size)
+{
+	if (!buf) {
+		return;
+	}
+
+	if (size < HUGE_PAGE_SIZE) {
+		free(buf);
+	} else {
+		munmap(buf, relay_buf_map_size(size));
+	}
+}
+
+/*
+ * Turn on SO_ZEROCOPY for a socket out_fd.  Not every transport has it
+ * (virtio-vsock only since Linux 6.7), in which case this direction just
+ * keeps copying.
+ */
+static void relay_dir_enable_zerocopy(struct relay_dir *dir)
+{
+	int one = 1;
+
+	if (setsockopt(dir->out_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+		dir->zerocopy = true;
+	} else if (errno != ENOTSOCK) {
+		fprintf(stderr, "SO_ZEROCOPY unavailable for fd %d: %s\n",
+			dir->out_fd, strerror(errno));
+	}
+}
+
+/* Mark the sends in [lo, hi] complete and release what is done in order */
+static void relay_dir_zc_complete(struct relay_dir *dir, uint32_t lo, uint32_t hi,
+				  bool copied)
+{
+	uint32_t n = hi - lo + 1;
+
+	dir->zc_stats.completions += n;
+	if (copied) {
+		dir->zc_stats.copied += n;
+	}
+
+	for (unsigned int i = 0; i < dir->zc_count; i++) {
+		struct zc_send *zs = &dir->zc_queue[(dir->zc_head + i) % ZC_QUEUE_LEN];
+
+		if (zs->seq - lo < n) {
+			zs->done = true;
+		}
+	}
+
+	while (dir->zc_count > 0 && dir->zc_queue[dir->zc_head].done) {
+		dir->zc_head = (dir->zc_head + 1) % ZC_QUEUE_LEN;
+		dir->zc_count--;
+	}
+}
+
+/* Drain out_fd's error queue of zerocopy completions, -1 on error */
+static int relay_dir_reap_zerocopy(struct relay_dir *dir)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+
+	for (;;) {
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		struct cmsghdr *cmsg;
+
+		if (recvmsg(dir->out_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				return 0;
+			}
+			perror("recvmsg");
+			return -1;
+		}
+
+		/* the cmsg level and type differ by family, the payload doesn't */
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err *serr = (void *)CMSG_DATA(cmsg);
+
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(*serr)) ||
+			    serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			relay_dir_zc_complete(dir, serr->ee_info, serr->ee_data,
+					      serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+}
+
+/*
+ * writev() the iovecs to out_fd, as a MSG_ZEROCOPY send if they are large
+ * enough and there is room to track the completion.
+ */
+static ssize_t relay_dir_write(struct relay_dir *dir, struct iovec *iov, int iovcnt)
+{
+	ssize_t nbytes;
+	size_t len = 0;
+
+	if (!dir->zerocopy) {
+		return writev(dir->out_fd, iov, iovcnt);
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (len < opt_zerocopy_min) {
+		dir->zc_stats.small++;
+		return writev(dir->out_fd, iov, iovcnt);
+	}
+	if (dir->zc_count == ZC_QUEUE_LEN) {
+		dir->zc_stats.fallbacks++;
+		return writev(dir->out_fd, iov, iovcnt);
+	}
+
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt,
+	};
+	nbytes = sendmsg(dir->out_fd, &msg, MSG_ZEROCOPY);
+	if (nbytes < 0 && errno == ENOBUFS) {
+		/* out of optmem for the notifications, copy this one */
+		dir->zc_stats.fallbacks++;
+		return writev(dir->out_fd, iov, iovcnt);
+	}
+	if (nbytes > 0) {
+		struct zc_send *zs = &dir->zc_queue[(dir->zc_head + dir->zc_count) % ZC_QUEUE_LEN];
+
+		zs->seq = dir->zc_seq++;
+		zs->done = false;
+		zs->start = dir->wr_off;
+		zs->end = dir->wr_off + nbytes;
+		dir->zc_count++;
+		dir->zc_stats.sends++;
+	}
+	return nbytes;
+}
+
+/*
+ * The kernel may still be reading a ring with zerocopy sends outstanding,
+ * so give their completions a moment to arrive before the ring is freed.
+ */
+static void relay_dir_finish_zerocopy(struct relay_dir *dir)
+{
+	struct pollfd pfd = {
+		.fd = dir->out_fd,
+		.events = 0,	/* POLLERR is always reported */
+	};
+	const struct zc_stats *st = &dir->zc_stats;
+
+	for (int tries = 0; dir->zc_count > 0 && tries < 10; tries++) {
+		if (poll(&pfd, 1, 100) < 0 || relay_dir_reap_zerocopy(dir) < 0) {
+			break;
+		}
+	}
+
+	if (!opt_keep_listening) {
+		fprintf(stderr, "zerocopy fd %d: %llu sends, %llu completions "
+				"(%llu copied), %llu below --zerocopy-min, %llu fallbacks\n",
+			dir->out_fd, st->sends, st->completions, st->copied,
+			st->small, st->fallbacks);
+	}
+}
+
+static int relay_dir_init(struct relay_dir *dir, int in_fd, int out_fd,
+			  struct dir_stats *stats)
+{
+	int ret;
+
+	dir->in_fd = in_fd;
+	dir->out_fd = out_fd;
+	dir->eof = false;
+	dir->rd_off = dir->wr_off = 0;
+	dir->use_splice = false;
+	dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+	dir->pipe_size = 0;
+	dir->pipe_bytes = 0;
+	dir->msg_in = fd_is_seqpacket(in_fd);
+	dir->msg_out = fd_is_seqpacket(out_fd);
+	dir->stats = stats;
+	dir->stall_start = 0;
+	memset(&dir->zc_stats, 0, sizeof(dir->zc_stats));
+	dir->zerocopy = false;
+	dir->zc_seq = 0;
+	dir->zc_head = dir->zc_count = 0;
+	if (opt_zerocopy) {
+		relay_dir_enable_zerocopy(dir);
+	}
+
+	dir->buf_size = opt_buf_size;
+	dir->buf = relay_buf_alloc(dir->buf_size);
+	if (!dir->buf) {
+		return -1;
+	}
+
+	/* splice() has no notion of message boundaries */
+	if (!opt_splice || dir->msg_in || dir->msg_out) {
+		return 0;
+	}
+
+	if (pipe2(dir->pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+		perror("pipe2");
+		dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+		return 0;
+	}
+
+	/*
+	 * Never let the pipe outgrow the ring so its contents can always be
+	 * moved over if splice turns out to be unsupported later on.
+	 */
+	fcntl(dir->pipe_fds[1], F_SETPIPE_SZ, dir->buf_size);
+	ret = fcntl(dir->pipe_fds[1], F_GETPIPE_SZ);
+	dir->pipe_size = ret > 0 && (size_t)ret < dir->buf_size ? ret : dir->buf_size;
+	dir->use_splice = true;
+	return 0;
+}
+
+static void relay_dir_cleanup(struct relay_dir *dir)
+{
+	if (dir->pipe_fds[0] >= 0) {
+		close(dir->pipe_fds[0]);
+		close(dir->pipe_fds[1]);
+		dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+	}
+	if (dir->zerocopy) {
+		relay_dir_finish_zerocopy(dir);
+	}
+	/* rather leak the ring than let it be reused under a pending send */
+	if (dir->zc_count == 0) {
+		relay_buf_free(dir->buf, dir->buf_size);
+	}
+	dir->buf = NULL;
+}
+
+/*
+ * Give up on splice for this direction after the kernel refused it for one
+ * of the fds.  Whatever is already in the pipe moves into the (empty) ring
+ * so no data is lost or reordered.
+ */
+static int relay_dir_unsplice(struct relay_dir *dir)
+{
+	fprintf(stderr, "splice not supported for fd %d -> fd %d, "
+			"falling back to read/write\n",
+			dir->in_fd, dir->out_fd);
+
+	while (dir->pipe_bytes > 0) {
+		ssize_t nbytes = read(dir->pipe_fds[0], dir->buf + dir->rd_off,
+				      dir->pipe_bytes);
+		if (nbytes <= 0) {
+			perror("read");
+			return -1;
+		}
+		dir->rd_off += nbytes;
+		dir->pipe_bytes -= nbytes;
+	}
+
+	close(dir->pipe_fds[0]);
+	close(dir->pipe_fds[1]);
+	dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+	dir->use_splice = false;
+	return 0;
+}
+
+/* Set up at most two iovecs covering len bytes of the ring from off */
+static int ring_iov(const struct relay_dir *dir, uint64_t off, size_t len,
+		    struct iovec iov[2])
+{
+	size_t idx = off % dir->buf_size;
+	size_t first = dir->buf_size - idx;
+
+	iov[0].iov_base = dir->buf + idx;
+	if (len <= first) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len = first;
+	iov[1].iov_base = dir->buf;
+	iov[1].iov_len = len - first;
+	return 2;
+}
+
+static bool fd_peer_shut_down(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLRDHUP };
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP));
+}
+
+/*
+ * Read one message from a seqpacket in_fd into the (empty) ring, starting
+ * at its beginning so the message is contiguous and goes out in a single
+ * write.
+ *
+ * recvmsg() returns 0 both at EOF and for a zero-length message, which has
+ * nothing to relay and is skipped.  It is EOF only once the peer has shut
+ * down, and even then one more read is needed to skip an empty message
+ * still queued ahead of the rest of the data.
+ */
+static ssize_t relay_dir_recv_msg(struct relay_dir *dir)
+{
+	struct iovec iov = {
+		.iov_base = dir->buf,
+		.iov_len = dir->buf_size,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t nbytes;
+	bool shut_down = false;
+
+	dir->rd_off = dir->wr_off = 0;
+	for (;;) {
+		msg.msg_flags = 0;
+		nbytes = recvmsg(dir->in_fd, &msg, 0);
+		if (nbytes != 0 || shut_down) {
+			break;
+		}
+		shut_down = fd_peer_shut_down(dir->in_fd);
+	}
+	if (nbytes >= 0 && (msg.msg_flags & MSG_TRUNC)) {
+		fprintf(stderr, "message on fd %d larger than the %zu byte relay buffer (see -B)\n",
+			dir->in_fd, dir->buf_size);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return nbytes;
+}
+
+/* Returns 0 on success or EAGAIN, -1 on error */
+static int relay_dir_fill(struct relay_dir *dir)
+{
+	struct iovec iov[2];
+	ssize_t nbytes;
+	int iovcnt;
+
+	if (!relay_dir_wants_read(dir)) {
+		return 0;
+	}
+
+	if (dir->msg_in) {
+		nbytes = relay_dir_recv_msg(dir);
+	} else if (dir->use_splice) {
+		nbytes = splice(dir->in_fd, NULL, dir->pipe_fds[1], NULL,
+				dir->pipe_size - dir->pipe_bytes,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (nbytes < 0 && errno == EINVAL) {
+			if (relay_dir_unsplice(dir) < 0) {
+				return -1;
+			}
+			return relay_dir_fill(dir);
+		}
+	} else {
+		iovcnt = ring_iov(dir, dir->rd_off,
+				  dir->buf_size - (dir->rd_off - relay_dir_released(dir)), iov);
+		nbytes = readv(dir->in_fd, iov, iovcnt);
+	}
+
+	stat_add(&dir->stats->reads, 1);
+	if (nbytes < 0) {
+		if (errno == EAGAIN) {
+			stat_add(&dir->stats->read_eagain, 1);
+		}
+		if (errno == EAGAIN || errno == EINTR) {
+			return 0;
+		}
+		perror("read");
+		return -1;
+	}
+
+	if (nbytes == 0) {
+		dir->eof = true;
+	} else if (dir->use_splice) {
+		dir->pipe_bytes += nbytes;
+	} else {
+		dir->rd_off += nbytes;
+	}
+	return 0;
+}
+
+/* Returns 0 on success or EAGAIN, -1 on error */
+static int relay_dir_flush(struct relay_dir *dir)
+{
+	struct iovec iov[2];
+	ssize_t nbytes;
+	int iovcnt;
+
+	while (relay_dir_pending(dir) > 0) {
+		size_t want = relay_dir_pending(dir);
+
+		if (dir->use_splice) {
+			nbytes = splice(dir->pipe_fds[0], NULL, dir->out_fd, NULL,
+					dir->pipe_bytes,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (nbytes < 0 && errno == EINVAL) {
+				if (relay_dir_unsplice(dir) < 0) {
+					return -1;
+				}
+				continue;
+			}
+		} else {
+			iovcnt = ring_iov(dir, dir->wr_off,
+					  dir->rd_off - dir->wr_off, iov);
+			nbytes = relay_dir_write(dir, iov, iovcnt);
+		}
+
+		stat_add(&dir->stats->writes, 1);
+		if (nbytes < 0) {
+			if (errno == EAGAIN) {
+				stat_add(&dir->stats->write_eagain, 1);
+				if (!dir->stall_start) {
+					dir->stall_start = stats_ticks();
+				}
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			return -1;
+		}
+
+		stat_add(&dir->stats->bytes, nbytes);
+		if ((size_t)nbytes < want) {
+			stat_add(&dir->stats->short_writes, 1);
+		}
+		if (dir->stall_start) {
+			stat_add(&dir->stats->stall_ticks, stats_ticks() - dir->stall_start);
+			dir->stall_start = 0;
+		}
+
+		if (dir->use_splice) {
+			dir->pipe_bytes -= nbytes;
+		} else {
+			dir->wr_off += nbytes;
+		}
+	}
+	return 0;
+}
+
+static uint32_t relay_fd_wanted_events(const struct relay_fd *rfd)
+{
+	uint32_t events = 0;
+
+	if (rfd->reader && relay_dir_wants_read(rfd->reader)) {
+		events |= EPOLLIN;
+	}
+	if (rfd->writer && relay_dir_pending(rfd->writer) > 0) {
+		events |= EPOLLOUT;
+	}
+	/* stay registered for the EPOLLERR that signals zerocopy completions */
+	if (rfd->writer && rfd->writer->zc_count > 0) {
+		events |= EPOLLERR;
+	}
+	return events;
+}
+
+/*
+ * Bring the epoll registration of rfd in line with what its directions
+ * currently need.  Fds without interest are removed entirely so a hung up
+ * peer cannot keep waking us while the other side is still draining.
+ */
+static int relay_fd_update(struct relay_fd *rfd, int epfd)
+{
+	uint32_t events = relay_fd_wanted_events(rfd);
+	struct epoll_event ev = {
+		.events = events,
+		.data.ptr = rfd,
+	};
+	int op;
+
+	if (!rfd->pollable || events == rfd->events) {
+		return 0;
+	}
+
+	if (events == 0) {
+		op = EPOLL_CTL_DEL;
+	} else if (rfd->events == 0) {
+		op = EPOLL_CTL_ADD;
+	} else {
+		op = EPOLL_CTL_MOD;
+	}
+
+	if (epoll_ctl(epfd, op, rfd->fd, &ev) != 0) {
+		if (op == EPOLL_CTL_ADD && errno == EPERM) {
+			/* Regular files are always ready, handled by relay_run() */
+			rfd->pollable = false;
+			return 0;
+		}
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	rfd->events = events;
+	return 0;
+}
+
+static void relay_add_fd(struct relay *relay, int fd,
+			 struct relay_dir *reader, struct relay_dir *writer)
+{
+	struct relay_fd *rfd = &relay->fds[relay->nfds++];
+
+	rfd->fd = fd;
+	rfd->relay = relay;
+	rfd->reader = reader;
+	rfd->writer = writer;
+	rfd->pollable = true;
+	rfd->events = 0;
+}
+
+/*
+ * Set up a relay between a local side, which may use separate fds for
+ * input and output, and a remote socket.  Fds are switched to non-blocking
+ * mode.
+ */
+static int relay_init(struct relay *relay, int local_in_fd, int local_out_fd,
+		      int remote_fd, struct dir_stats stats[2])
+{
+	struct relay_dir *to_remote = &relay->dirs[0];
+	struct relay_dir *from_remote = &relay->dirs[1];
+
+	relay->nfds = 0;
+	relay->done = false;
+
+	if (relay_dir_init(to_remote, local_in_fd, remote_fd, &stats[0]) < 0) {
+		return -1;
+	}
+	if (relay_dir_init(from_remote, remote_fd, local_out_fd, &stats[1]) < 0) {
+		relay_dir_cleanup(to_remote);
+		return -1;
+	}
+
+	set_nonblock(local_in_fd, true);
+	set_nonblock(local_out_fd, true);
 	set_nonblock(remote_fd, true);
 
+	if (local_in_fd == local_out_fd) {
+		relay_add_fd(relay, local_in_fd, to_remote, from_remote);
+	} else {
+		relay_add_fd(relay, local_in_fd, to_remote, NULL);
+		relay_add_fd(relay, local_out_fd, NULL, from_remote);
+	}
+	relay_add_fd(relay, remote_fd, from_remote, to_remote);
+	return 0;
+}
+
+static void relay_cleanup(struct relay *relay, int epfd)
+{
+	for (int i = 0; i < relay->nfds; i++) {
+		struct relay_fd *rfd = &relay->fds[i];
+
+		if (rfd->events) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, rfd->fd, NULL);
+			rfd->events = 0;
+		}
+	}
+
+	relay_dir_cleanup(&relay->dirs[0]);
+	relay_dir_cleanup(&relay->dirs[1]);
+}
+
+/*
+ * Service one fd of a relay.  Reads are followed straight away by an
+ * attempt to write the data out, which saves a trip through epoll whenever
+ * the other side is not backed up.  The relay is done once a direction has
+ * seen EOF and delivered everything, or on any error.
+ */
+static void relay_handle(struct relay_fd *rfd, uint32_t events, int epfd)
+{
+	struct relay *relay = rfd->relay;
+	bool hup = events & (EPOLLERR | EPOLLHUP);
+
+	if (relay->done) {
+		return;
+	}
+
+	if (rfd->writer && rfd->writer->zerocopy && (events & EPOLLERR)) {
+		if (relay_dir_reap_zerocopy(rfd->writer) < 0) {
+			relay->done = true;
+			return;
+		}
+	}
+
+	if (rfd->writer && (events & EPOLLOUT || hup)) {
+		if (relay_dir_flush(rfd->writer) < 0) {
+			relay->done = true;
+			return;
+		}
+	}
+
+	if (rfd->reader && (events & EPOLLIN || hup)) {
+		if (relay_dir_fill(rfd->reader) < 0 ||
+		    relay_dir_flush(rfd->reader) < 0) {
+			relay->done = true;
+			return;
+		}
+	}
+
+	for (int i = 0; i < 2; i++) {
+		struct relay_dir *dir = &relay->dirs[i];
+
+		if (dir->eof && relay_dir_pending(dir) == 0) {
+			relay->done = true;
+			return;
+		}
+	}
+
+	for (int i = 0; i < relay->nfds; i++) {
+		if (relay_fd_update(&relay->fds[i], epfd) < 0) {
+			relay->done = true;
+			return;
+		}
+	}
+}
+
+static void relay_run(struct relay *relay)
+{
+	struct epoll_event events[4];
+	int epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+
+	for (int i = 0; i < relay->nfds; i++) {
+		if (relay_fd_update(&relay->fds[i], epfd) < 0) {
+			relay->done = true;
+		}
+	}
+
+	while (!relay->done) {
+		int timeout = -1;
+		int n;
+
+		/* Fds epoll cannot watch are treated as permanently ready */
+		for (int i = 0; i < relay->nfds; i++) {
+			struct relay_fd *rfd = &relay->fds[i];
+
+			if (!rfd->pollable && relay_fd_wanted_events(rfd)) {
+				timeout = 0;
+			}
+		}
+
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n && !relay->done; i++) {
+			relay_handle(events[i].data.ptr, events[i].events, epfd);
+		}
+
+		for (int i = 0; i < relay->nfds && !relay->done; i++) {
+			struct relay_fd *rfd = &relay->fds[i];
+			uint32_t wanted;
+
+			if (rfd->pollable) {
+				continue;
+			}
+			wanted = relay_fd_wanted_events(rfd);
+			if (wanted) {
+				relay_handle(rfd, wanted, epfd);
+			}
+		}
+	}
+
+	relay_cleanup(relay, epfd);
+	close(epfd);
+}
+
+/*
+ * Full duplex relay (-D) for a single session: each direction runs on its
+ * own thread, polling only its own fds, so the two can each keep a core
+ * busy.  A direction that sees EOF passes it on with shutdown(SHUT_WR) (or
+ * by closing a local out_fd that is not a socket) and leaves the other
+ * direction running until it sees EOF too.  A local in_fd that is not a
+ * socket (eg: a terminal) never learns that the remote closed though, so
+ * then EOF from the remote stops both through stop_fd, as does an error.
+ */
+struct duplex_dir {
+	struct relay_dir dir;
+	pthread_t thread;
+	int cpu;		/* -1 to leave unpinned */
+	int stop_fd;		/* eventfd shared by both directions */
+	bool stop_on_eof;	/* signal stop_fd at EOF, see above */
+	const struct relay_dir *writer;	/* the other direction, if it writes in_fd */
+	int ret;
+};
+
+static void duplex_pin(int cpu)
+{
+	cpu_set_t set;
+	int ret;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_setaffinity_np cpu %d: %s\n", cpu, strerror(ret));
+	}
+}
+
+static void duplex_stop(struct duplex_dir *d)
+{
+	uint64_t one = 1;
+
+	if (write(d->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("write");
+	}
+}
+
+static void duplex_fail(struct duplex_dir *d)
+{
+	d->ret = -1;
+	duplex_stop(d);
+}
+
+/*
+ * Waits until this direction can make progress.  Returns 0 for that, 1 once
+ * stop_fd has been signalled and -1 on error.
+ */
+static int duplex_wait(struct duplex_dir *d)
+{
+	struct relay_dir *dir = &d->dir;
+	bool out = relay_dir_pending(dir) > 0;
+	struct pollfd pfds[3] = {
+		{ .fd = d->stop_fd, .events = POLLIN },
+		{ .fd = relay_dir_wants_read(dir) ? dir->in_fd : -1, .events = POLLIN },
+		/* with nothing to write, only for zerocopy completions (POLLERR) */
+		{ .fd = out || dir->zc_count > 0 ? dir->out_fd : -1, .events = out ? POLLOUT : 0 },
+	};
+
+	for (;;) {
+		if (poll(pfds, 3, -1) < 0) {
+			if (errno == EINTR) {
+				return 0;
+			}
+			perror("poll");
+			return -1;
+		}
+		if (pfds[0].revents) {
+			return 1;
+		}
+		/*
+		 * POLLERR alone on in_fd is the other direction's zerocopy
+		 * completions.  That thread owns the socket's error queue and
+		 * is woken to drain it too, so give it the cpu rather than
+		 * spin on them here.
+		 */
+		if (!d->writer || !d->writer->zerocopy ||
+		    pfds[1].revents != POLLERR || pfds[2].revents) {
+			return 0;
+		}
+		sched_yield();
+	}
+}
+
+static void *duplex_main(void *opaque)
+{
+	struct duplex_dir *d = opaque;
+	struct relay_dir *dir = &d->dir;
+
+	if (d->cpu >= 0) {
+		duplex_pin(d->cpu);
+	}
+
+	while (!dir->eof || relay_dir_pending(dir) > 0) {
+		int ret = duplex_wait(d);
+
+		if (ret > 0) {
+			return NULL;
+		}
+		if (ret < 0 || relay_dir_fill(dir) < 0 || relay_dir_flush(dir) < 0 ||
+		    (dir->zerocopy && relay_dir_reap_zerocopy(dir) < 0)) {
+			duplex_fail(d);
+			return NULL;
+		}
+	}
+
+	if (shutdown(dir->out_fd, SHUT_WR) != 0) {
+		if (errno == ENOTSOCK) {
+			close(dir->out_fd);
+		} else if (errno != ENOTCONN) {
+			perror("shutdown");
+		}
+	}
+	if (d->stop_on_eof) {
+		duplex_stop(d);
+	}
+	return NULL;
+}
+
+static void duplex_run(int local_in_fd, int local_out_fd, int remote_fd)
+{
+	struct duplex_dir dirs[2] = {
+		{ .cpu = opt_duplex_cpus[0] },
+		{ .cpu = opt_duplex_cpus[1], .stop_on_eof = !fd_is_socket(local_in_fd) },
+	};
+	int stop_fd;
+	int ret;
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		perror("eventfd");
+		return;
+	}
+	dirs[0].stop_fd = dirs[1].stop_fd = stop_fd;
+	dirs[1].writer = &dirs[0].dir;
+	if (fds_same_file(local_in_fd, local_out_fd)) {
+		dirs[0].writer = &dirs[1].dir;
+	}
+
+	if (relay_dir_init(&dirs[0].dir, local_in_fd, remote_fd, &session_stats[0]) < 0) {
+		close(stop_fd);
+		return;
+	}
+	if (relay_dir_init(&dirs[1].dir, remote_fd, local_out_fd, &session_stats[1]) < 0) {
+		relay_dir_cleanup(&dirs[0].dir);
+		close(stop_fd);
+		return;
+	}
+
+	/* the threads block in poll() only, so they always see stop_fd */
+	set_nonblock(local_in_fd, true);
+	set_nonblock(local_out_fd, true);
+	set_nonblock(remote_fd, true);
+
+	ret = pthread_create(&dirs[0].thread, NULL, duplex_main, &dirs[0]);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		goto out;
+	}
+
+	ret = pthread_create(&dirs[1].thread, NULL, duplex_main, &dirs[1]);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		duplex_fail(&dirs[1]);
+		pthread_join(dirs[0].thread, NULL);
+		goto out;
+	}
+
+	pthread_join(dirs[0].thread, NULL);
+	pthread_join(dirs[1].thread, NULL);
+
+out:
+	relay_dir_cleanup(&dirs[0].dir);
+	relay_dir_cleanup(&dirs[1].dir);
+	close(stop_fd);
+}
+
+/*
+ * io_uring relay engine (-E io_uring), for single-session mode.  Both
+ * directions always keep a read posted into one of their registered
+ * buffers.  When a read completes its write is queued and submitted in the
+ * same io_uring_enter() call that re-arms the read and waits for the next
+ * completion, so a message costs one syscall instead of select() + read()
+ * + write().  io_uring is driven through the raw syscalls so there is no
+ * build dependency on liburing.
+ */
+#define URING_BUFS_PER_DIR 4
+#define URING_ENTRIES 16
+
+struct uring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int to_submit;
+};
+
+/*
+ * Buffers are used strictly in order: reads fill slot rd_slot, the single
+ * in-flight write drains slot wr_slot.  Slots are counted monotonically
+ * and reduced modulo URING_BUFS_PER_DIR.
+ */
+struct uring_dir {
+	int in_fd;
+	int out_fd;
+	char *bufs[URING_BUFS_PER_DIR];
+	unsigned int buf_index;	/* registered buffer index of slot 0 */
+	size_t len[URING_BUFS_PER_DIR];
+	unsigned int rd_slot;
+	unsigned int wr_slot;
+	size_t wr_done;		/* bytes of wr_slot already written */
+	bool read_inflight;
+	bool write_inflight;
+	bool eof;
+	struct dir_stats *stats;
+};
+
+static bool uring_fixed_bufs;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_cleanup(struct uring *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_len);
+	}
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_len);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+}
+
+static int uring_init(struct uring *ring)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+
+	/* Reads use the current file position so pipes and ttys work */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		fprintf(stderr, "io_uring lacks IORING_FEAT_RW_CUR_POS\n");
+		goto fail;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len) {
+			ring->sq_len = ring->cq_len;
+		}
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		perror("mmap");
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			perror("mmap");
+			goto fail;
+		}
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		perror("mmap");
+		goto fail;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+	return 0;
+
+fail:
+	uring_cleanup(ring);
+	return -1;
+}
+
+/* At most 2 reads and 2 writes are in flight, so the SQ never fills up */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+static void uring_prep_rw(struct uring *ring, struct uring_dir *dir, int op,
+			  int fd, char *addr, size_t len, unsigned int slot,
+			  uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+	if (uring_fixed_bufs) {
+		sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED :
+						     IORING_OP_WRITE_FIXED;
+		sqe->buf_index = dir->buf_index + slot % URING_BUFS_PER_DIR;
+	} else {
+		sqe->opcode = op;
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;	/* current file position */
+	sqe->user_data = user_data;
+}
+
+/* user_data is the direction index with the low bit set for writes */
+static void uring_dir_post(struct uring *ring, struct uring_dir *dirs, int i)
+{
+	struct uring_dir *dir = &dirs[i];
+	size_t buf_size = opt_buf_size;
+
+	if (!dir->eof && !dir->read_inflight &&
+	    dir->rd_slot - dir->wr_slot < URING_BUFS_PER_DIR) {
+		unsigned int slot = dir->rd_slot % URING_BUFS_PER_DIR;
+
+		uring_prep_rw(ring, dir, IORING_OP_READ, dir->in_fd,
+			      dir->bufs[slot], buf_size,
+			      slot, i << 1);
+		dir->read_inflight = true;
+	}
+
+	if (!dir->write_inflight && dir->wr_slot != dir->rd_slot) {
+		unsigned int slot = dir->wr_slot % URING_BUFS_PER_DIR;
+
+		uring_prep_rw(ring, dir, IORING_OP_WRITE, dir->out_fd,
+			      dir->bufs[slot] + dir->wr_done,
+			      dir->len[slot] - dir->wr_done,
+			      slot, i << 1 | 1);
+		dir->write_inflight = true;
+	}
+}
+
+/* Returns 1 when the relay is finished, 0 to continue, -1 on error */
+static int uring_dir_complete(struct uring_dir *dir, bool is_write, int res)
+{
+	unsigned int slot;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		/* Just post the same request again */
+	} else if (res < 0) {
+		errno = -res;
+		perror(is_write ? "write" : "read");
+		return -1;
+	} else if (is_write) {
+		slot = dir->wr_slot % URING_BUFS_PER_DIR;
+		stat_add(&dir->stats->writes, 1);
+		stat_add(&dir->stats->bytes, res);
+		if ((size_t)res < dir->len[slot] - dir->wr_done) {
+			stat_add(&dir->stats->short_writes, 1);
+		}
+		dir->wr_done += res;
+		if (dir->wr_done == dir->len[slot]) {
+			dir->wr_slot++;
+			dir->wr_done = 0;
+		}
+	} else if (res == 0) {
+		stat_add(&dir->stats->reads, 1);
+		dir->eof = true;
+	} else {
+		stat_add(&dir->stats->reads, 1);
+		dir->len[dir->rd_slot % URING_BUFS_PER_DIR] = res;
+		dir->rd_slot++;
+	}
+
+	if (is_write) {
+		dir->write_inflight = false;
+	} else {
+		dir->read_inflight = false;
+	}
+
+	return dir->eof && dir->wr_slot == dir->rd_slot && !dir->write_inflight;
+}
+
+/*
+ * Returns -1 without having transferred anything if io_uring cannot be
+ * used, so the caller can fall back to epoll.
+ */
+static int uring_relay_run(int local_in_fd, int local_out_fd, int remote_fd)
+{
+	struct uring ring;
+	struct uring_dir dirs[2] = {
+		{ .in_fd = local_in_fd, .out_fd = remote_fd, .stats = &session_stats[0] },
+		{ .in_fd = remote_fd, .out_fd = local_out_fd, .stats = &session_stats[1] },
+	};
+	struct iovec iov[2 * URING_BUFS_PER_DIR];
+	size_t buf_size = opt_buf_size;
+	bool done = false;
+	int ret = -1;
+
+	if (uring_init(&ring) < 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		dirs[i].buf_index = i * URING_BUFS_PER_DIR;
+
+		for (int j = 0; j < URING_BUFS_PER_DIR; j++) {
+			dirs[i].bufs[j] = relay_buf_alloc(buf_size);
+			if (!dirs[i].bufs[j]) {
+				goto out;
+			}
+			iov[dirs[i].buf_index + j].iov_base = dirs[i].bufs[j];
+			iov[dirs[i].buf_index + j].iov_len = buf_size;
+		}
+	}
+
+	/* Registration may exceed RLIMIT_MEMLOCK, plain reads/writes still work */
+	uring_fixed_bufs = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS,
+						 iov, 2 * URING_BUFS_PER_DIR) == 0;
+	if (!uring_fixed_bufs) {
+		perror("io_uring_register");
+		fprintf(stderr, "io_uring: continuing without registered buffers\n");
+	}
+
+	/* io_uring waits for readiness itself, keep the fds blocking */
+	set_nonblock(local_in_fd, false);
+	set_nonblock(local_out_fd, false);
+	set_nonblock(remote_fd, false);
+
+	ret = 0;
+	uring_dir_post(&ring, dirs, 0);
+	uring_dir_post(&ring, dirs, 1);
+
+	while (!done) {
+		unsigned int head;
+		unsigned int tail;
+
+		if (sys_io_uring_enter(ring.fd, ring.to_submit, 1,
+				       IORING_ENTER_GETEVENTS) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("io_uring_enter");
+			break;
+		}
+		ring.to_submit = 0;
+
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail && !done; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			int i = cqe->user_data >> 1;
+
+			if (uring_dir_complete(&dirs[i], cqe->user_data & 1, cqe->res) != 0) {
+				done = true;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		if (!done) {
+			uring_dir_post(&ring, dirs, 0);
+			uring_dir_post(&ring, dirs, 1);
+		}
+	}
+
+out:
+	/* Closing the ring cancels whatever is still in flight */
+	uring_cleanup(&ring);
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < URING_BUFS_PER_DIR; j++) {
+			relay_buf_free(dirs[i].bufs[j], buf_size);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Persistent vsock -> TCP proxy (-k).  The main thread accepts vsock
+ * connections, dials the TCP destination for each of them and hands the
+ * pair to the worker with the fewest connections.  Every worker runs its
+ * own epoll loop over all of its relays.
+ */
+struct proxy_conn {
+	struct relay relay;	/* first, epoll events lead back to it */
+	int vsock_fd;
+	int tcp_fd;
+	struct proxy_conn *next;	/* on the pending or reap list */
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int wake_fd;		/* eventfd, registered with epfd as NULL */
+	pthread_mutex_t lock;
+	struct proxy_conn *pending;	/* handed over, not yet registered */
+	unsigned int nconns;	/* accessed atomically */
+	struct dir_stats stats[2];	/* over all of this worker's relays */
+};
+
+/* For the stats thread, set once the workers are running */
+static struct worker *proxy_workers;
+static int proxy_nworkers;
+
+static void proxy_conn_free(struct proxy_conn *conn, int epfd)
+{
+	relay_cleanup(&conn->relay, epfd);
+	close(conn->vsock_fd);
+	close(conn->tcp_fd);
+	free(conn);
+}
+
+/* Register connections handed over by the acceptor with our epoll */
+static void worker_take_pending(struct worker *worker)
+{
+	struct proxy_conn *conn;
+	uint64_t val;
+
+	if (read(worker->wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		perror("read");
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	conn = worker->pending;
+	worker->pending = NULL;
+	pthread_mutex_unlock(&worker->lock);
+
+	while (conn) {
+		struct proxy_conn *next = conn->next;
+
+		for (int i = 0; i < conn->relay.nfds; i++) {
+			if (relay_fd_update(&conn->relay.fds[i], worker->epfd) < 0) {
+				conn->relay.done = true;
+				break;
+			}
+		}
+
+		if (conn->relay.done) {
+			proxy_conn_free(conn, worker->epfd);
+			__atomic_sub_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+		}
+		conn = next;
+	}
+}
+
+static void *worker_main(void *opaque)
+{
+	struct worker *worker = opaque;
+	struct epoll_event events[64];
+
+	for (;;) {
+		struct proxy_conn *reap = NULL;
+		int n;
+
+		n = epoll_wait(worker->epfd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct relay_fd *rfd = events[i].data.ptr;
+			struct proxy_conn *conn;
+
+			if (!rfd) {
+				worker_take_pending(worker);
+				continue;
+			}
+
+			conn = (struct proxy_conn *)rfd->relay;
+			if (conn->relay.done) {
+				continue;
+			}
+
+			relay_handle(rfd, events[i].events, worker->epfd);
+
+			/*
+			 * Later events in this batch may still point at the
+			 * connection, so only free it once the batch is done.
+			 */
+			if (conn->relay.done) {
+				conn->next = reap;
+				reap = conn;
+			}
+		}
+
+		while (reap) {
+			struct proxy_conn *conn = reap;
+
+			reap = conn->next;
+			proxy_conn_free(conn, worker->epfd);
+			__atomic_sub_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static struct worker *pick_worker(struct worker *workers, int nworkers)
+{
+	struct worker *best = &workers[0];
+
+	for (int i = 1; i < nworkers; i++) {
+		if (__atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED) <
+		    __atomic_load_n(&best->nconns, __ATOMIC_RELAXED)) {
+			best = &workers[i];
+		}
+	}
+	return best;
+}
+
+static int proxy_add_conn(struct worker *worker, int vsock_fd, int tcp_fd)
+{
+	struct proxy_conn *conn = calloc(1, sizeof(*conn));
+	uint64_t val = 1;
+
+	if (!conn) {
+		perror("calloc");
+		return -1;
+	}
+
+	conn->vsock_fd = vsock_fd;
+	conn->tcp_fd = tcp_fd;
+	if (relay_init(&conn->relay, tcp_fd, tcp_fd, vsock_fd, worker->stats) < 0) {
+		free(conn);
+		return -1;
+	}
+
+	__atomic_add_fetch(&worker->nconns, 1, __ATOMIC_RELAXED);
+
+	/* The worker owns the connection from here on */
+	pthread_mutex_lock(&worker->lock);
+	conn->next = worker->pending;
+	worker->pending = conn;
+	pthread_mutex_unlock(&worker->lock);
+
+	if (write(worker->wake_fd, &val, sizeof(val)) < 0) {
+		perror("write");
+	}
+	return 0;
+}
+
+static int worker_start(struct worker *worker)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	int ret;
+
+	pthread_mutex_init(&worker->lock, NULL);
+
+	worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (worker->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (worker->wake_fd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+
+	if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wake_fd, &ev) != 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	ret = pthread_create(&worker->thread, NULL, worker_main, worker);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Warm TCP connections for -k -P <n>.  A background thread keeps up to
+ * size connections to the (once resolved) destination open so accepted
+ * vsock sessions do not wait for a handshake.
+ */
+struct tcp_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t taken;	/* signalled when the pool drops below size */
+	int *fds;
+	int size;
+	int count;
+	const struct addrinfo *addrs;
+	pthread_t thread;
+};
+
+static void *tcp_pool_main(void *opaque)
+{
+	struct tcp_pool *pool = opaque;
+
+	for (;;) {
+		int fd;
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->count >= pool->size) {
+			pthread_cond_wait(&pool->taken, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		fd = tcp_connect_addrinfo(pool->addrs);
+		if (fd < 0) {
+			/* Destination down, don't hammer it */
+			sleep(1);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		pool->fds[pool->count++] = fd;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+static int tcp_pool_start(struct tcp_pool *pool, int size,
+			  const struct addrinfo *addrs)
+{
+	int ret;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->taken, NULL);
+	pool->size = size;
+	pool->count = 0;
+	pool->addrs = addrs;
+	pool->fds = calloc(size, sizeof(pool->fds[0]));
+	if (!pool->fds) {
+		perror("calloc");
+		return -1;
+	}
+
+	ret = pthread_create(&pool->thread, NULL, tcp_pool_main, pool);
+	if (ret != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+		return -1;
+	}
+	return 0;
+}
+
+/* The destination may have closed an idle connection in the meantime */
+static bool tcp_pool_fd_alive(int fd)
+{
+	char c;
+	ssize_t ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return ret > 0 || (ret < 0 && errno == EAGAIN);
+}
+
+/* Take a warm connection, or connect right away if none is left */
+static int tcp_pool_take(struct tcp_pool *pool)
+{
+	for (;;) {
+		int fd;
+
+		pthread_mutex_lock(&pool->lock);
+		if (pool->count == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return tcp_connect_addrinfo(pool->addrs);
+		}
+		/* Newest first, it is the least likely to have timed out */
+		fd = pool->fds[--pool->count];
+		pthread_cond_signal(&pool->taken);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (tcp_pool_fd_alive(fd)) {
+			return fd;
+		}
+		close(fd);
+	}
+}
+
+/* Start -W workers (default: one per CPU), returning how many in *nworkers */
+static struct worker *proxy_start_workers(int *nworkers)
+{
+	struct worker *workers;
+	int n = opt_workers;
+
+	if (n <= 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = ncpus > 0 ? ncpus : 1;
+	}
+
+	workers = calloc(n, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return NULL;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (worker_start(&workers[i]) < 0) {
+			return NULL;
+		}
+	}
+	proxy_nworkers = n;
+	__atomic_store_n(&proxy_workers, workers, __ATOMIC_RELEASE);
+
+	*nworkers = n;
+	return workers;
+}
+
+static int run_proxy(void)
+{
+	struct worker *workers;
+	int nworkers;
+	struct addrinfo *tcp_addrs;
+	struct tcp_pool pool;
+	int listen_fd;
+
+	/* A peer going away must only end its own connection */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Resolve once, not for every connection */
+	tcp_addrs = tcp_resolve(opt_tcp_dst, opt_tcp_dstport, AF_INET);
+	if (!tcp_addrs) {
+		return -1;
+	}
+
+	if (opt_pool > 0 && tcp_pool_start(&pool, opt_pool, tcp_addrs) < 0) {
+		return -1;
+	}
+
+	listen_fd = vsock_listen_fd(opt_listen_port, SOMAXCONN);
+	if (listen_fd < 0) {
+		return -1;
+	}
+
+	workers = proxy_start_workers(&nworkers);
+	if (!workers) {
+		close(listen_fd);
+		return -1;
+	}
+
+	for (;;) {
+		int vsock_fd;
+		int tcp_fd;
+
+		vsock_fd = vsock_accept(listen_fd);
+		if (vsock_fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				/* Give workers a chance to release fds */
+				usleep(100 * 1000);
+			}
+			continue;
+		}
+
+		if (opt_pool > 0) {
+			tcp_fd = tcp_pool_take(&pool);
+		} else {
+			tcp_fd = tcp_connect_addrinfo(tcp_addrs);
+		}
+		if (tcp_fd < 0) {
+			close(vsock_fd);
+			continue;
+		}
+
+		if (proxy_add_conn(pick_worker(workers, nworkers), vsock_fd, tcp_fd) < 0) {
+			close(vsock_fd);
+			close(tcp_fd);
+		}
+	}
+	return 0;
+}
+
+/*
+ * TCP -> vsock gateway (-G).  The main thread accepts on every -G port and
+ * looks up each session's destination, reading the client's header line
+ * first on ports without a route of their own, then connects to the guest
+ * and hands the pair to a worker just like -k.  Header reads, the connect()
+ * and passing on what followed the header are all non-blocking, so a slow
+ * client or guest cannot hold up the others.
+ */
+struct gateway_fd {
+	int fd;
+	bool listener;
+	const struct route *route;	/* a listener's own route, or the one a
+					   handshake is connecting to */
+	char peer[64];			/* client address, for handshakes */
+	char header[GATEWAY_HEADER_MAX];
+	size_t header_len;
+	time_t deadline;		/* CLOCK_MONOTONIC seconds */
+	int vsock_fd;			/* connecting to the route, or -1 */
+	size_t early_off;		/* header bytes from here on go to vsock_fd */
+	struct gateway_fd *next;	/* handshakes awaiting their header */
+};
+
+static time_t monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static const struct route *route_lookup(const char *key)
+{
+	for (int i = 0; i < opt_nroutes; i++) {
+		if (strcmp(opt_routes[i].key, key) == 0) {
+			return &opt_routes[i];
+		}
+	}
+	return NULL;
+}
+
+/* [<addr>:]<port>, with an IPv6 addr in brackets */
+static int gateway_listen(const char *gateway, struct gateway_fd *gfd)
+{
+	char addr[64] = "127.0.0.1";
+	const char *port_str = strrchr(gateway, ':');
+	const char *addr_str = gateway;
+	size_t addr_len;
+	struct addrinfo *res;
+	int one = 1;
+	int fd;
+
+	if (port_str) {
+		addr_len = port_str - gateway;
+		if (gateway[0] == '[' && addr_len >= 2 && gateway[addr_len - 1] == ']') {
+			addr_str++;
+			addr_len -= 2;
+		} else if (memchr(gateway, ':', addr_len)) {
+			fprintf(stderr, "%s: IPv6 addresses go in brackets, eg: [::1]:8000\n", gateway);
+			return -1;
+		}
+		snprintf(addr, sizeof(addr), "%.*s", (int)addr_len, addr_str);
+		port_str++;
+	} else {
+		port_str = gateway;
+	}
+
+	res = tcp_resolve(addr, port_str, AF_UNSPEC);
+	if (!res) {
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd < 0) {
+		perror("socket");
+		freeaddrinfo(res);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+		perror(gateway);
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	gfd->fd = fd;
+	gfd->listener = true;
+	gfd->route = route_lookup(port_str);
+	return 0;
+}
+
+static void gateway_drop(struct gateway_fd *hs, int epfd)
+{
+	if (hs->fd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, hs->fd, NULL);
+		close(hs->fd);
+	}
+	if (hs->vsock_fd >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, hs->vsock_fd, NULL);
+		close(hs->vsock_fd);
+	}
+	hs->fd = hs->vsock_fd = -1;
+}
+
+/*
+ * Start connecting to the route's guest.  The connect() completes in the
+ * background, so a guest that is slow to accept (or not there) only holds
+ * up its own session, see gateway_connected().
+ */
+static int gateway_connect(struct gateway_fd *hs, const struct route *route, int epfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data.ptr = hs,
+	};
+
+	fprintf(stderr, "Connection from %s, relaying to cid %u port %u...\n",
+		hs->peer, route->cid, route->port);
+
+	hs->route = route;
+	hs->vsock_fd = vsock_connect_port(route->cid, route->port, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (hs->vsock_fd < 0) {
+		return -1;
+	}
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, hs->vsock_fd, &ev) != 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	hs->deadline = monotonic_now() + GATEWAY_CONNECT_TIMEOUT_SEC;
+	return 0;
+}
+
+/*
+ * The connect() to the guest has completed: pass on whatever followed the
+ * header line and hand the session over.  Returns 1 once handed over, 0 to
+ * wait for room to write the rest, -1 to drop it.
+ */
+static int gateway_connected(struct gateway_fd *hs, int epfd,
+			     struct worker *workers, int nworkers)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(hs->vsock_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+		err = errno;
+	}
+	if (err != 0) {
+		fprintf(stderr, "%s: connect to cid %u port %u: %s\n", hs->peer,
+			hs->route->cid, hs->route->port, strerror(err));
+		return -1;
+	}
+
+	while (hs->early_off < hs->header_len) {
+		ssize_t nbytes = write(hs->vsock_fd, hs->header + hs->early_off,
+				       hs->header_len - hs->early_off);
+
+		if (nbytes < 0 && errno == EINTR) {
+			continue;
+		} else if (nbytes < 0 && errno == EAGAIN) {
+			return 0;
+		} else if (nbytes <= 0) {
+			perror("write");
+			return -1;
+		}
+		hs->early_off += nbytes;
+	}
+
+	/* the worker's epoll takes over the fd */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, hs->vsock_fd, NULL);
+	if (proxy_add_conn(pick_worker(workers, nworkers), hs->vsock_fd, hs->fd) < 0) {
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Read what has arrived of a handshake's header line, and start connecting
+ * to its route once it is all there.  Returns 0 on success or to wait for
+ * more, -1 to drop it.
+ */
+static int gateway_read_header(struct gateway_fd *hs, int epfd)
+{
+	const struct route *route;
+	ssize_t nbytes;
+	char *nl;
+
+	nbytes = recv(hs->fd, hs->header + hs->header_len,
+		      sizeof(hs->header) - hs->header_len, 0);
+	if (nbytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	} else if (nbytes <= 0) {
+		return -1;
+	}
+	hs->header_len += nbytes;
+
+	nl = memchr(hs->header, '\n', hs->header_len);
+	if (!nl) {
+		if (hs->header_len == sizeof(hs->header)) {
+			fprintf(stderr, "%s: header line too long\n", hs->peer);
+			return -1;
+		}
+		return 0;
+	}
+
+	*nl = '\0';
+	if (nl > hs->header && nl[-1] == '\r') {
+		nl[-1] = '\0';
+	}
+	route = route_lookup(hs->header);
+	if (!route) {
+		fprintf(stderr, "%s: no route for '%s'\n", hs->peer, hs->header);
+		return -1;
+	}
+
+	/* anything more the client sends waits in its socket for the relay */
+	epoll_ctl(epfd, EPOLL_CTL_DEL, hs->fd, NULL);
+	hs->early_off = nl + 1 - hs->header;
+	return gateway_connect(hs, route, epfd);
+}
+
+static void gateway_accept(struct gateway_fd *listener, int epfd,
+			   struct gateway_fd **handshakes)
+{
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	char peer[64] = "?";
+	struct gateway_fd *hs;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	int fd;
+
+	fd = accept4(listener->fd, (struct sockaddr *)&sa, &salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			perror("accept");
+		}
+		if (errno == EMFILE || errno == ENFILE) {
+			/* Give workers a chance to release fds */
+			usleep(100 * 1000);
+		}
+		return;
+	}
+	tcp_set_buffer_size(fd);
+	getnameinfo((struct sockaddr *)&sa, salen, peer, sizeof(peer), NULL, 0, NI_NUMERICHOST);
+
+	hs = calloc(1, sizeof(*hs));
+	if (!hs) {
+		perror("calloc");
+		close(fd);
+		return;
+	}
+	hs->fd = fd;
+	hs->vsock_fd = -1;
+	snprintf(hs->peer, sizeof(hs->peer), "%s", peer);
+
+	if (listener->route) {
+		if (gateway_connect(hs, listener->route, epfd) < 0) {
+			gateway_drop(hs, epfd);
+			free(hs);
+			return;
+		}
+	} else {
+		hs->deadline = monotonic_now() + GATEWAY_HEADER_TIMEOUT_SEC;
+		ev.data.ptr = hs;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			perror("epoll_ctl");
+			close(fd);
+			free(hs);
+			return;
+		}
+	}
+	hs->next = *handshakes;
+	*handshakes = hs;
+}
+
+static int run_gateway(void)
+{
+	struct gateway_fd listeners[GATEWAY_MAX_LISTENERS];
+	struct gateway_fd *handshakes = NULL;
+	struct worker *workers;
+	int nworkers;
+	int epfd;
+
+	/* A peer going away must only end its own connection */
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	for (int i = 0; i < opt_ngateways; i++) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = &listeners[i],
+		};
+
+		memset(&listeners[i], 0, sizeof(listeners[i]));
+		if (gateway_listen(opt_gateways[i], &listeners[i]) < 0) {
+			return -1;
+		}
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev) != 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	workers = proxy_start_workers(&nworkers);
+	if (!workers) {
+		return -1;
+	}
+
 	for (;;) {
-		FD_ZERO(&rfds);
-		FD_SET(STDIN_FILENO, &rfds);
-		FD_SET(remote_fd, &rfds);
+		struct epoll_event events[64];
+		struct gateway_fd **link;
+		time_t now;
+		int ret;
+		int n;
 
-		if (select(nfds, &rfds, NULL, NULL, NULL) < 0) {
+		n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), 1000);
+		if (n < 0) {
 			if (errno == EINTR) {
 				continue;
-			} else {
-				perror("select");
-				return;
 			}
+			perror("epoll_wait");
+			return -1;
 		}
 
-		if (FD_ISSET(STDIN_FILENO, &rfds)) {
-			if (xfer_data(STDIN_FILENO, remote_fd) < 0) {
-				return;
+		for (int i = 0; i < n; i++) {
+			struct gateway_fd *gfd = events[i].data.ptr;
+
+			if (gfd->listener) {
+				gateway_accept(gfd, epfd, &handshakes);
+				continue;
+			}
+			if (gfd->fd < 0) {
+				continue;	/* dropped earlier in this batch */
+			}
+
+			if (gfd->vsock_fd >= 0) {
+				ret = gateway_connected(gfd, epfd, workers, nworkers);
+			} else {
+				ret = gateway_read_header(gfd, epfd);
+			}
+			if (ret < 0) {
+				gateway_drop(gfd, epfd);
+			} else if (ret > 0) {
+				/* the worker owns the fds now */
+				gfd->fd = gfd->vsock_fd = -1;
 			}
 		}
 
-		if (FD_ISSET(remote_fd, &rfds)) {
-			if (xfer_data(remote_fd, STDOUT_FILENO) < 0) {
-				return;
+		/* Sweep out finished handshakes and those that ran out of time */
+		now = monotonic_now();
+		for (link = &handshakes; *link; ) {
+			struct gateway_fd *hs = *link;
+
+			if (hs->fd >= 0 && now >= hs->deadline) {
+				if (hs->vsock_fd >= 0) {
+					fprintf(stderr, "%s: timed out connecting to cid %u port %u\n",
+						hs->peer, hs->route->cid, hs->route->port);
+				} else {
+					fprintf(stderr, "%s: timed out waiting for the header line\n", hs->peer);
+				}
+				gateway_drop(hs, epfd);
+			}
+			if (hs->fd < 0) {
+				*link = hs->next;
+				free(hs);
+			} else {
+				link = &hs->next;
 			}
 		}
 	}
+	return 0;
+}
+
+/*
+ * Stats thread, with --stats only.  SIGUSR1 is then blocked in every thread
+ * and collected here with sigtimedwait(), whose timeout doubles as the
+ * --stats-interval timer, so the relays never see the signal.  Each dump is
+ * one JSON line summing the counters over all threads, with rates since the
+ * previous dump.
+ */
+struct stats_totals {
+	struct dir_stats dirs[2];
+	unsigned int conns;
+};
+
+static double stats_ticks_per_ns;
+
+static double monotonic_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats_calibrate(void)
+{
+	struct timespec delay = { .tv_nsec = 50 * 1000 * 1000 };
+	double start = monotonic_sec();
+	uint64_t start_ticks = stats_ticks();
+
+	nanosleep(&delay, NULL);
+	stats_ticks_per_ns = (stats_ticks() - start_ticks) / ((monotonic_sec() - start) * 1e9);
+}
+
+static void stats_sum(struct dir_stats *dst, const struct dir_stats *src)
+{
+	dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+	dst->reads += __atomic_load_n(&src->reads, __ATOMIC_RELAXED);
+	dst->writes += __atomic_load_n(&src->writes, __ATOMIC_RELAXED);
+	dst->short_writes += __atomic_load_n(&src->short_writes, __ATOMIC_RELAXED);
+	dst->read_eagain += __atomic_load_n(&src->read_eagain, __ATOMIC_RELAXED);
+	dst->write_eagain += __atomic_load_n(&src->write_eagain, __ATOMIC_RELAXED);
+	dst->stall_ticks += __atomic_load_n(&src->stall_ticks, __ATOMIC_RELAXED);
+}
+
+static void stats_collect(struct stats_totals *t)
+{
+	struct worker *workers = __atomic_load_n(&proxy_workers, __ATOMIC_ACQUIRE);
+
+	memset(t, 0, sizeof(*t));
+	for (int d = 0; d < 2; d++) {
+		stats_sum(&t->dirs[d], &session_stats[d]);
+	}
+	if (!workers) {
+		t->conns = 1;
+		return;
+	}
+	for (int i = 0; i < proxy_nworkers; i++) {
+		for (int d = 0; d < 2; d++) {
+			stats_sum(&t->dirs[d], &workers[i].stats[d]);
+		}
+		t->conns += __atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED);
+	}
+}
+
+static void stats_dump(const struct stats_totals *t, const struct stats_totals *prev,
+		       double elapsed, double interval)
+{
+	char line[1024];
+	int len;
+
+	len = snprintf(line, sizeof(line), "{\"elapsed\":%.3f,\"conns\":%u",
+		       elapsed, t->conns);
+	for (int d = 0; d < 2; d++) {
+		const struct dir_stats *s = &t->dirs[d];
+
+		len += snprintf(line + len, sizeof(line) - len,
+				",\"%s\":{\"bytes\":%llu,\"bytes_per_sec\":%.0f,"
+				"\"reads\":%llu,\"writes\":%llu,\"short_writes\":%llu,"
+				"\"read_eagain\":%llu,\"write_eagain\":%llu,\"stall_ns\":%.0f}",
+				dir_names[d],
+				(unsigned long long)s->bytes,
+				interval > 0 ? (s->bytes - prev->dirs[d].bytes) / interval : 0,
+				(unsigned long long)s->reads,
+				(unsigned long long)s->writes,
+				(unsigned long long)s->short_writes,
+				(unsigned long long)s->read_eagain,
+				(unsigned long long)s->write_eagain,
+				s->stall_ticks / stats_ticks_per_ns);
+	}
+	len += snprintf(line + len, sizeof(line) - len, "}\n");
+
+	if (write(opt_stats_fd, line, len) < 0) {
+		perror("write stats");
+	}
+}
+
+static void *stats_main(void *opaque)
+{
+	sigset_t *set = opaque;
+	struct timespec timeout = {
+		.tv_sec = opt_stats_interval,
+		.tv_nsec = (opt_stats_interval - (time_t)opt_stats_interval) * 1e9,
+	};
+	struct stats_totals prev = { 0 };
+	double start, last;
+
+	stats_calibrate();
+	start = last = monotonic_sec();
+
+	for (;;) {
+		struct stats_totals t;
+		double now;
+		int sig;
+
+		if (opt_stats_interval > 0) {
+			sig = sigtimedwait(set, NULL, &timeout);
+		} else {
+			sig = sigwaitinfo(set, NULL);
+		}
+		if (sig < 0 && errno != EAGAIN) {
+			continue;	/* EINTR */
+		}
+
+		now = monotonic_sec();
+		stats_collect(&t);
+		stats_dump(&t, &prev, now - start, now - last);
+		prev = t;
+		last = now;
+	}
+	return NULL;
+}
+
+/*
+ * Blocks SIGUSR1, before any other thread exists so that they all inherit
+ * the mask, and starts the stats thread.
+ */
+static int stats_start(void)
+{
+	static sigset_t set;
+	pthread_t thread;
+	int ret;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	ret = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (ret == 0) {
+		ret = pthread_create(&thread, NULL, stats_main, &set);
+	}
+	if (ret != 0) {
+		fprintf(stderr, "stats thread: %s\n", strerror(ret));
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+static void main_loop(int remote_fd)
+{
+	struct relay relay;
+
+	if (opt_duplex) {
+		duplex_run(STDIN_FILENO, STDOUT_FILENO, remote_fd);
+		return;
+	}
+
+	if (opt_engine == ENGINE_IO_URING) {
+		if (uring_relay_run(STDIN_FILENO, STDOUT_FILENO, remote_fd) == 0) {
+			return;
+		}
+		fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+	}
+
+	if (relay_init(&relay, STDIN_FILENO, STDOUT_FILENO, remote_fd, session_stats) < 0) {
+		return;
+	}
+
+	relay_run(&relay);
 }
 
 int main(int argc, char **argv)
 {
-	int remote_fd = get_remote_fd(argc, argv);
+	int remote_fd;
+
+	if (parse_args(argc, argv) < 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	vsock_socket_setup = vsock_set_buffer_size;
+
+	if (opt_stats && stats_start() < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if (opt_keep_listening) {
+		return run_proxy() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (opt_ngateways > 0) {
+		return run_gateway() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
+	remote_fd = get_remote_fd();
 	if (remote_fd < 0) {
 		return EXIT_FAILURE;
 	}
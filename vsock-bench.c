@@ -0,0 +1,899 @@
+/**
+ * vsock-bench.c
+ *
+ * See vsock-bench.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <cpuid.h>
+#include <math.h>
+#include <limits.h>
+
+#include "vsock-bench.h"
+
+double tsc_hz;
+const char *tsc_hz_source = "unknown";
+
+uint32_t msg_sizes[MAX_SWEEP_SIZES];
+int n_msg_sizes = 1;
+bool sweep = false;
+long min_msg_size = 1;
+
+// Estimate the TSC frequency against CLOCK_MONOTONIC_RAW.
+double calibrate_tsc_hz()
+{
+	struct timespec begin_ts, end_ts;
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 50 * 1000 * 1000 };
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &begin_ts);
+	tsc_t begin_tsc = begin_rdtsc();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_ts);
+	tsc_t end_tsc = end_rdtsc();
+
+	double elapsed = (end_ts.tv_sec - begin_ts.tv_sec) + (end_ts.tv_nsec - begin_ts.tv_nsec) / 1e9;
+	return (end_tsc - begin_tsc) / elapsed;
+}
+
+// The TSC frequency as enumerated by the CPU (leaf 0x15) or, in a VM, the
+// hypervisor (the 0x40000010 timing leaf, which is where guests with
+// tsc_known_freq typically got it from), or 0 if neither says.
+double cpuid_tsc_hz()
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(0x15, &eax, &ebx, &ecx, &edx) && eax != 0 && ebx != 0 && ecx != 0)
+	{
+		return (double)ecx * ebx / eax;
+	}
+
+	// The 0x40000000 leaves are only defined with the hypervisor present
+	// bit set, on bare metal they can echo the highest basic leaf instead.
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & (1u << 31)))
+	{
+		return 0;
+	}
+	__cpuid(0x40000000, eax, ebx, ecx, edx);
+	if (eax >= 0x40000010)
+	{
+		__cpuid(0x40000010, eax, ebx, ecx, edx);
+		if (eax != 0)
+		{
+			return eax * 1000.0;
+		}
+	}
+	return 0;
+}
+
+void tsc_init()
+{
+	tsc_hz = cpuid_tsc_hz();
+	tsc_hz_source = "cpuid";
+	if (tsc_hz == 0)
+	{
+		tsc_hz = calibrate_tsc_hz();
+		tsc_hz_source = "calibrated";
+	}
+	fprintf(stderr, "tsc: %.3f MHz (%s)\n", tsc_hz / 1e6, tsc_hz_source);
+}
+
+void hist_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ULLONG_MAX;
+}
+
+// lowest value that lands in bucket idx
+tsc_t hist_bucket_low(unsigned int idx)
+{
+	if (idx < (1U << HIST_SUB_BITS))
+	{
+		return idx;
+	}
+	unsigned int shift = idx / HIST_HALF_COUNT - 1;
+	return (tsc_t)(idx - shift * HIST_HALF_COUNT) << shift;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	for (unsigned int i=0; i<HIST_BUCKETS; i++)
+	{
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+	dst->sum += src->sum;
+	dst->sum_sq += src->sum_sq;
+}
+
+tsc_t hist_percentile(const struct histogram *h, double p)
+{
+	if (h->count == 0)
+	{
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+	rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+
+	uint64_t seen = 0;
+	for (unsigned int i=0; i<HIST_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= rank)
+		{
+			tsc_t low = hist_bucket_low(i);
+			tsc_t high = i + 1 < HIST_BUCKETS ? hist_bucket_low(i + 1) - 1 : ULLONG_MAX;
+			tsc_t mid = low + (high - low) / 2;
+			return mid < h->min ? h->min : mid > h->max ? h->max : mid;
+		}
+	}
+	return h->max;
+}
+
+void hist_avg_stddev(const struct histogram *h, long double *avg, long double *stddev)
+{
+	*avg = 0;
+	*stddev = 0;
+	if (h->count > 0)
+	{
+		*avg = h->sum / h->count;
+		long double var = h->sum_sq / h->count - *avg * *avg;
+		*stddev = var > 0 ? sqrtl(var) : 0;
+	}
+}
+
+void print_summary(uint32_t msg_size, tsc_t initial, const struct histogram *h)
+{
+	static bool printed_header = false;
+
+	long double avg, stddev;
+	hist_avg_stddev(h, &avg, &stddev);
+	tsc_t min = h->count ? h->min : 0;
+
+	if (sweep)
+	{
+		if (!printed_header)
+		{
+			fprintf(stdout, "%10s %5s %12s %12s %12s %12s %12s %12s %12s %12s %14s %14s\n",
+				"size", "unit", "initial", "min", "p50", "p90", "p99", "p99.9", "p99.99", "max", "avg", "stddev");
+			printed_header = true;
+		}
+		tsc_t p50 = hist_percentile(h, 50);
+		tsc_t p90 = hist_percentile(h, 90);
+		tsc_t p99 = hist_percentile(h, 99);
+		tsc_t p999 = hist_percentile(h, 99.9);
+		tsc_t p9999 = hist_percentile(h, 99.99);
+		fprintf(stdout, "%10u %5s %12llu %12llu %12llu %12llu %12llu %12llu %12llu %12llu %14.3Lf %14.3Lf\n",
+			msg_size, "ticks", initial, min, p50, p90, p99, p999, p9999, h->max, avg, stddev);
+		fprintf(stdout, "%10u %5s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %14.3f %14.3f\n",
+			msg_size, "ns", tsc_to_ns(initial), tsc_to_ns(min), tsc_to_ns(p50), tsc_to_ns(p90),
+			tsc_to_ns(p99), tsc_to_ns(p999), tsc_to_ns(p9999), tsc_to_ns(h->max),
+			tsc_to_ns(avg), tsc_to_ns(stddev));
+		fflush(stdout);
+		return;
+	}
+
+	// ticks, with nanoseconds alongside
+	fprintf(stdout, "Initial connection/send: %llu (%.1f ns)\n", initial, tsc_to_ns(initial));
+	fprintf(stdout, "min: %llu (%.1f ns)\n", min, tsc_to_ns(min));
+	fprintf(stdout, "max: %llu (%.1f ns)\n", h->max, tsc_to_ns(h->max));
+	fprintf(stdout, "median: %llu (%.1f ns)\n", hist_percentile(h, 50), tsc_to_ns(hist_percentile(h, 50)));
+	fprintf(stdout, "p90: %llu (%.1f ns)\n", hist_percentile(h, 90), tsc_to_ns(hist_percentile(h, 90)));
+	fprintf(stdout, "p99: %llu (%.1f ns)\n", hist_percentile(h, 99), tsc_to_ns(hist_percentile(h, 99)));
+	fprintf(stdout, "p99.9: %llu (%.1f ns)\n", hist_percentile(h, 99.9), tsc_to_ns(hist_percentile(h, 99.9)));
+	fprintf(stdout, "p99.99: %llu (%.1f ns)\n", hist_percentile(h, 99.99), tsc_to_ns(hist_percentile(h, 99.99)));
+	fprintf(stdout, "avg: %Lf (%.1f ns)\n", avg, tsc_to_ns(avg));
+	fprintf(stdout, "stddev: %Lf (%.1f ns)\n", stddev, tsc_to_ns(stddev));
+}
+
+// Accepts an optional K or M (binary) suffix.
+long parse_size(const char *size_str, char **end)
+{
+	long val = strtol(size_str, end, 10);
+	int shift = 0;
+	if (*end == size_str || val < 0)
+	{
+		return -1;
+	}
+	if (**end == 'k' || **end == 'K')
+	{
+		shift = 10;
+	}
+	else if (**end == 'm' || **end == 'M')
+	{
+		shift = 20;
+	}
+	else if (**end == 'g' || **end == 'G')
+	{
+		shift = 30;
+	}
+	if (shift)
+	{
+		(*end)++;
+	}
+	if (val > (LONG_MAX >> shift))
+	{
+		return -1;
+	}
+	return val << shift;
+}
+
+bool valid_msg_size(long size)
+{
+	if (size < min_msg_size || size > MAX_MESSAGE_LENGTH)
+	{
+		fprintf(stderr, "message size must be between %ld and %d bytes\n", min_msg_size, MAX_MESSAGE_LENGTH);
+		return false;
+	}
+	return true;
+}
+
+// Either a comma separated list of sizes ("8,100,1K") or a range whose
+// powers of two get walked ("8-64K").
+int parse_sweep(const char *sweep_str)
+{
+	char *end;
+	long first = parse_size(sweep_str, &end);
+
+	n_msg_sizes = 0;
+	if (*end == '-')
+	{
+		long last = parse_size(end + 1, &end);
+		if (*end != '\0' || !valid_msg_size(first) || !valid_msg_size(last) || last < first)
+		{
+			return -1;
+		}
+		for (long size = first; size <= last && n_msg_sizes < MAX_SWEEP_SIZES; size *= 2)
+		{
+			msg_sizes[n_msg_sizes++] = size;
+		}
+		return 0;
+	}
+
+	for (;;)
+	{
+		if (!valid_msg_size(first) || n_msg_sizes == MAX_SWEEP_SIZES)
+		{
+			return -1;
+		}
+		msg_sizes[n_msg_sizes++] = first;
+		if (*end == '\0')
+		{
+			return 0;
+		}
+		if (*end != ',')
+		{
+			return -1;
+		}
+		first = parse_size(end + 1, &end);
+	}
+}
+
+unsigned int warmup_iterations = 0;
+double warmup_sec = 0;
+bool warming_up = false;
+unsigned int n_trials = 0;
+double converge_pct = 0;
+
+int parse_warmup(const char *warmup_str)
+{
+	char *end;
+	double val = strtod(warmup_str, &end);
+	if (end == warmup_str || val <= 0)
+	{
+		return -1;
+	}
+	if (strcmp(end, "s") == 0)
+	{
+		warmup_sec = val;
+	}
+	else if (strcmp(end, "ms") == 0)
+	{
+		warmup_sec = val / 1000;
+	}
+	else if (*end == '\0' && val == (unsigned int)val)
+	{
+		warmup_iterations = val;
+	}
+	else
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int trials_init()
+{
+	if (n_trials == 0)
+	{
+		n_trials = converge_pct > 0 ? DEFAULT_CONVERGE_TRIALS : 1;
+	}
+	if (n_trials > MAX_TRIALS || (converge_pct > 0 && n_trials < MIN_CONVERGE_TRIALS))
+	{
+		fprintf(stderr, "--trials takes up to %d, and at least %d with --converge.\n", MAX_TRIALS, MIN_CONVERGE_TRIALS);
+		return -1;
+	}
+	return 0;
+}
+
+void trials_reset(struct trial_series *s)
+{
+	s->n = 0;
+	s->initial = 0;
+	s->iterations = 0;
+	hist_reset(&s->hist);
+}
+
+void trials_add(struct trial_series *s, tsc_t initial, const struct histogram *h, unsigned int iterations)
+{
+	if (s->n == 0)
+	{
+		s->initial = initial;
+	}
+	s->p50[s->n] = hist_percentile(h, 50);
+	s->p99[s->n] = hist_percentile(h, 99);
+	s->n++;
+	s->iterations += iterations;
+	hist_merge(&s->hist, h);
+}
+
+#define BOOTSTRAP_RESAMPLES 2000
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Percentile bootstrap of the mean of n per-trial values: resampling the
+// trials (with replacement, from a fixed seed so reruns agree) gives the
+// spread of the mean, and its middle 95% is the interval.  Resampling
+// whole trials keeps the run-to-run variance in it, which is what single
+// runs hide.
+static void bootstrap_ci(const tsc_t *values, unsigned int n, double *mean, double *low, double *high)
+{
+	static double means[BOOTSTRAP_RESAMPLES];
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+	double sum = 0;
+	for (unsigned int i=0; i<n; i++)
+	{
+		sum += values[i];
+	}
+	*mean = sum / n;
+
+	for (int b=0; b<BOOTSTRAP_RESAMPLES; b++)
+	{
+		sum = 0;
+		for (unsigned int i=0; i<n; i++)
+		{
+			// xorshift64
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			sum += values[rng % n];
+		}
+		means[b] = sum / n;
+	}
+	qsort(means, BOOTSTRAP_RESAMPLES, sizeof(means[0]), compare_doubles);
+	*low = means[(int)(BOOTSTRAP_RESAMPLES * 0.025)];
+	*high = means[(int)(BOOTSTRAP_RESAMPLES * 0.975) - 1];
+}
+
+static bool ci_within(const tsc_t *values, unsigned int n, double pct)
+{
+	double mean, low, high;
+	bootstrap_ci(values, n, &mean, &low, &high);
+	return mean > 0 && (high - low) / mean * 100 <= pct;
+}
+
+bool trials_converged(const struct trial_series *s)
+{
+	return converge_pct > 0 && s->n >= MIN_CONVERGE_TRIALS &&
+		ci_within(s->p50, s->n, converge_pct) && ci_within(s->p99, s->n, converge_pct);
+}
+
+static void print_trial_ci(uint32_t msg_size, const char *name, const tsc_t *values, unsigned int n)
+{
+	double mean, low, high;
+	bootstrap_ci(values, n, &mean, &low, &high);
+	if (sweep)
+	{
+		fprintf(stdout, "%10u ", msg_size);
+	}
+	fprintf(stdout, "%s over %u trials: %.1f [%.1f, %.1f] ticks (%.1f [%.1f, %.1f] ns), 95%% CI width %.2f%%\n",
+		name, n, mean, low, high, tsc_to_ns(mean), tsc_to_ns(low), tsc_to_ns(high),
+		mean > 0 ? (high - low) / mean * 100 : 0);
+}
+
+void print_trials(uint32_t msg_size, const struct trial_series *s)
+{
+	print_trial_ci(msg_size, "p50", s->p50, s->n);
+	print_trial_ci(msg_size, "p99", s->p99, s->n);
+	if (converge_pct > 0 && !trials_converged(s))
+	{
+		fprintf(stderr, "warning: size %u didn't converge to %.2f%% within %u trials\n", msg_size, converge_pct, s->n);
+	}
+	fflush(stdout);
+}
+
+bool perf_enabled = false;
+tsc_t perf_outlier_ticks = 0;
+
+static const struct
+{
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_events[N_PERF_COUNTERS] = {
+	[PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[PERF_CPU_MIGRATIONS] = { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	[PERF_PAGE_FAULTS] = { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	[PERF_CACHE_MISSES] = { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+};
+
+// All the counters are in one group, so a single read() gets them together.
+struct perf_reading
+{
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[N_PERF_COUNTERS];
+};
+
+static int perf_group_fd = -1;
+// Where each counter is in the group's values, or -1 if it isn't open.
+static int perf_index[N_PERF_COUNTERS];
+
+static struct perf_reading perf_run_begin, perf_run_end, perf_sample_start;
+// With --perf-outliers, the counters summed over the samples above the
+// threshold and over the rest.
+static double perf_outlier_sums[N_PERF_COUNTERS], perf_other_sums[N_PERF_COUNTERS];
+static uint64_t n_perf_outliers, n_perf_others;
+
+static int perf_event_open_counter(enum perf_counter c, bool exclude_kernel)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[c].type;
+	attr.config = perf_events[c].config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, perf_group_fd, 0);
+}
+
+int perf_open()
+{
+	bool exclude_kernel = false;
+	int n_open = 0;
+
+	for (int c=0; c<N_PERF_COUNTERS; c++)
+	{
+		int fd = perf_event_open_counter(c, exclude_kernel);
+		if (fd < 0 && (errno == EACCES || errno == EPERM) && !exclude_kernel)
+		{
+			// perf_event_paranoid > 1 only lets us count user space.
+			exclude_kernel = true;
+			fd = perf_event_open_counter(c, exclude_kernel);
+		}
+		if (fd < 0)
+		{
+			fprintf(stderr, "perf: %s unavailable: %s\n", perf_events[c].name, strerror(errno));
+			perf_index[c] = -1;
+			continue;
+		}
+		if (perf_group_fd < 0)
+		{
+			perf_group_fd = fd;
+		}
+		perf_index[c] = n_open++;
+	}
+
+	if (n_open == 0)
+	{
+		fprintf(stderr, "perf: no counters available (see /proc/sys/kernel/perf_event_paranoid)\n");
+		return -1;
+	}
+	if (exclude_kernel)
+	{
+		fprintf(stderr, "perf: counting user space only (perf_event_paranoid), so time in the kernel isn't included\n");
+	}
+	return 0;
+}
+
+static void perf_read(struct perf_reading *r)
+{
+	if (read(perf_group_fd, r, sizeof(*r)) <= 0)
+	{
+		perror("perf read");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// The change in counter c from begin to end.  When the group only got part
+// of the PMU's time (eg: shared with other perf users), it's scaled up to
+// the whole interval.
+static double perf_delta(const struct perf_reading *begin, const struct perf_reading *end, int c)
+{
+	int idx = perf_index[c];
+	uint64_t enabled = end->time_enabled - begin->time_enabled;
+	uint64_t running = end->time_running - begin->time_running;
+	double delta = end->values[idx] - begin->values[idx];
+	return running > 0 && running < enabled ? delta * enabled / running : delta;
+}
+
+void perf_begin_run()
+{
+	if (perf_group_fd < 0)
+	{
+		return;
+	}
+	memset(perf_outlier_sums, 0, sizeof(perf_outlier_sums));
+	memset(perf_other_sums, 0, sizeof(perf_other_sums));
+	n_perf_outliers = 0;
+	n_perf_others = 0;
+	perf_read(&perf_run_begin);
+}
+
+void perf_end_run()
+{
+	if (perf_group_fd >= 0)
+	{
+		perf_read(&perf_run_end);
+	}
+}
+
+void perf_read_sample_begin()
+{
+	perf_read(&perf_sample_start);
+}
+
+void perf_read_sample_end(tsc_t latency)
+{
+	struct perf_reading now;
+	perf_read(&now);
+
+	bool outlier = latency > perf_outlier_ticks;
+	double *sums = outlier ? perf_outlier_sums : perf_other_sums;
+	for (int c=0; c<N_PERF_COUNTERS; c++)
+	{
+		if (perf_index[c] >= 0)
+		{
+			sums[c] += perf_delta(&perf_sample_start, &now, c);
+		}
+	}
+	if (outlier)
+	{
+		n_perf_outliers++;
+	}
+	else
+	{
+		n_perf_others++;
+	}
+}
+
+// One line of counters divided by n, starting with label.
+static void print_perf_line(const char *label, const double *counts, uint64_t n)
+{
+	fprintf(stdout, "%s", label);
+	for (int c=0; c<N_PERF_COUNTERS; c++)
+	{
+		if (perf_index[c] >= 0)
+		{
+			fprintf(stdout, " %s %.3f", perf_events[c].name, n ? counts[c] / n : 0);
+		}
+	}
+	if (perf_index[PERF_INSTRUCTIONS] >= 0 && perf_index[PERF_CYCLES] >= 0 && counts[PERF_CYCLES] > 0)
+	{
+		fprintf(stdout, " ipc %.2f", counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+	}
+	fprintf(stdout, "\n");
+}
+
+void print_perf(uint32_t msg_size, unsigned int n)
+{
+	if (perf_group_fd < 0)
+	{
+		return;
+	}
+
+	char label[64];
+	double counts[N_PERF_COUNTERS] = { 0 };
+	for (int c=0; c<N_PERF_COUNTERS; c++)
+	{
+		if (perf_index[c] >= 0)
+		{
+			counts[c] = perf_delta(&perf_run_begin, &perf_run_end, c);
+		}
+	}
+	// Sweeps label each line with the size, like their stats rows.
+	if (sweep)
+	{
+		snprintf(label, sizeof(label), "perf %u (per iteration):", msg_size);
+	}
+	else
+	{
+		snprintf(label, sizeof(label), "perf (per iteration):");
+	}
+	print_perf_line(label, counts, n);
+
+	if (perf_outlier_ticks)
+	{
+		snprintf(label, sizeof(label), "perf %lu over %llu ticks (per sample):", n_perf_outliers, perf_outlier_ticks);
+		print_perf_line(label, perf_outlier_sums, n_perf_outliers);
+		snprintf(label, sizeof(label), "perf %lu others (per sample):", n_perf_others);
+		print_perf_line(label, perf_other_sums, n_perf_others);
+	}
+	fflush(stdout);
+}
+
+int rt_fifo_priority = 0;
+bool rt_mlock = false;
+int rt_cpu = -1;
+
+#define PREFAULT_STACK_SIZE (512 * 1024)
+
+void prefault(void *buf, size_t len)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *ptr = buf;
+	for (size_t off=0; off<len; off+=page_size)
+	{
+		ptr[off] = ptr[off];
+	}
+}
+
+// Grows the stack as far as we'll plausibly need while timing.
+static void prefault_stack()
+{
+	char stack[PREFAULT_STACK_SIZE];
+	memset(stack, 0, sizeof(stack));
+	// Keep the memset from being optimized out.
+	__asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+// Whether cpu is in a sysfs cpu list like 2-5,7 (empty if none).
+static bool cpu_in_list(const char *list, int cpu)
+{
+	const char *ptr = list;
+	while (*ptr != '\0' && *ptr != '\n')
+	{
+		char *end;
+		long first = strtol(ptr, &end, 10);
+		long last = first;
+		if (end == ptr)
+		{
+			return false;
+		}
+		if (*end == '-')
+		{
+			ptr = end + 1;
+			last = strtol(ptr, &end, 10);
+		}
+		if (cpu >= first && cpu <= last)
+		{
+			return true;
+		}
+		ptr = *end == ',' ? end + 1 : end;
+	}
+	return false;
+}
+
+// Reads the first line of path into buf, returning -1 if there isn't one.
+static int read_sysfs(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+	{
+		return -1;
+	}
+	char *line = fgets(buf, len, f);
+	fclose(f);
+	if (!line)
+	{
+		return -1;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+void warn_cpu_tuning(int cpu)
+{
+	char buf[256];
+	char path[128];
+
+	if (read_sysfs("/sys/devices/system/cpu/isolated", buf, sizeof(buf)) == 0 && !cpu_in_list(buf, cpu))
+	{
+		fprintf(stderr, "warning: cpu %d isn't isolated (isolcpus=), so other tasks may still run on it\n", cpu);
+	}
+
+	// Without cpufreq (eg: in most VMs) there's nothing to check.
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+	if (read_sysfs(path, buf, sizeof(buf)) == 0 && strcmp(buf, "performance") != 0)
+	{
+		fprintf(stderr, "warning: cpu %d uses the %s frequency governor, not performance\n", cpu, buf);
+	}
+}
+
+int rt_setup()
+{
+	if (rt_cpu >= 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt_cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		{
+			perror("sched_setaffinity");
+			return -1;
+		}
+		warn_cpu_tuning(rt_cpu);
+	}
+
+	if (rt_fifo_priority > 0)
+	{
+		struct sched_param param = { .sched_priority = rt_fifo_priority };
+		if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+		{
+			perror("sched_setscheduler(SCHED_FIFO)");
+			return -1;
+		}
+	}
+
+	if (rt_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+	{
+		perror("mlockall");
+		return -1;
+	}
+
+	prefault_stack();
+	return 0;
+}
+
+bool timeline_enabled = false;
+tsc_t timeline_window_ticks = 0;
+uint64_t timeline_window_samples = 0;
+
+static struct histogram window_hist;
+static tsc_t window_start;
+static tsc_t window_max_tsc;
+static tsc_t timeline_start;
+static struct timeline_window *windows;
+static size_t n_windows, max_windows;
+
+int parse_timeline(const char *window_str)
+{
+	char *end;
+	double val = strtod(window_str, &end);
+	if (end == window_str || val <= 0)
+	{
+		return -1;
+	}
+	timeline_window_ticks = 0;
+	timeline_window_samples = 0;
+	if (strcmp(end, "s") == 0 || strcmp(end, "ms") == 0 || strcmp(end, "us") == 0)
+	{
+		// tsc_hz isn't known yet, see timeline_begin_run().
+		timeline_window_ticks = val * (end[0] == 's' ? 1e9 : end[0] == 'm' ? 1e6 : 1e3);
+	}
+	else if (*end == '\0' && val == (uint64_t)val)
+	{
+		timeline_window_samples = val;
+	}
+	else
+	{
+		return -1;
+	}
+	timeline_enabled = true;
+	return 0;
+}
+
+void timeline_begin_run()
+{
+	static bool ticks_converted = false;
+
+	if (!timeline_enabled)
+	{
+		return;
+	}
+	// parse_timeline() left the window in ns.
+	if (timeline_window_ticks && !ticks_converted)
+	{
+		timeline_window_ticks = timeline_window_ticks * tsc_hz / 1e9;
+		timeline_window_ticks = timeline_window_ticks ? timeline_window_ticks : 1;
+		ticks_converted = true;
+	}
+	n_windows = 0;
+	hist_reset(&window_hist);
+	timeline_start = window_start = __rdtsc();
+}
+
+static void close_window()
+{
+	if (window_hist.count == 0)
+	{
+		return;
+	}
+	if (n_windows == max_windows)
+	{
+		max_windows = max_windows ? max_windows * 2 : 1024;
+		windows = realloc(windows, max_windows * sizeof(*windows));
+		if (!windows)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	struct timeline_window *w = &windows[n_windows++];
+	w->start = window_start;
+	w->count = window_hist.count;
+	w->p50 = hist_percentile(&window_hist, 50);
+	w->p99 = hist_percentile(&window_hist, 99);
+	w->max = window_hist.max;
+	w->max_tsc = window_max_tsc;
+	hist_reset(&window_hist);
+}
+
+void timeline_record_sample(tsc_t latency)
+{
+	tsc_t now = __rdtsc();
+
+	if (timeline_window_ticks && now - window_start >= timeline_window_ticks)
+	{
+		close_window();
+		// Windows stay on a fixed grid from the start of the run, any
+		// without samples (eg: during a long stall) are left out.
+		window_start += (now - window_start) / timeline_window_ticks * timeline_window_ticks;
+	}
+
+	if (latency > window_hist.max || window_hist.count == 0)
+	{
+		window_max_tsc = now;
+	}
+	hist_record(&window_hist, latency);
+
+	if (timeline_window_samples && window_hist.count == timeline_window_samples)
+	{
+		close_window();
+		window_start = now;
+	}
+}
+
+void print_timeline(uint32_t msg_size)
+{
+	if (!timeline_enabled)
+	{
+		return;
+	}
+	close_window();
+
+	fprintf(stdout, "%10s %8s %12s %10s %12s %12s %12s %20s\n",
+		"size", "window", "start_ms", "count", "p50", "p99", "max", "max_tsc");
+	for (size_t i=0; i<n_windows; i++)
+	{
+		struct timeline_window *w = &windows[i];
+		fprintf(stdout, "%10u %8zu %12.3f %10lu %12llu %12llu %12llu %20llu\n",
+			msg_size, i, (w->start - timeline_start) / tsc_hz * 1e3, w->count,
+			w->p50, w->p99, w->max, w->max_tsc);
+	}
+	fflush(stdout);
+}
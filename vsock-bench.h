@@ -0,0 +1,265 @@
+/**
+ * vsock-bench.h
+ *
+ * The measurement side shared by the latency benchmarks: TSC timestamps,
+ * the histograms samples are recorded in, the message size options and
+ * the summary every run is reported with, so that results from either
+ * tool (and any transport) stay comparable.
+ */
+
+#ifndef VSOCK_BENCH_H
+#define VSOCK_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <x86intrin.h>
+
+typedef unsigned long long tsc_t;
+
+#define MAX_SWEEP_SIZES 64
+#define MAX_MESSAGE_LENGTH (16 * 1024 * 1024)
+
+static inline tsc_t begin_rdtsc()
+{
+	// use lfence to prevent CPU reordering of the rdtsc instruction
+	// (instead of cpuid which is more heavyweight)
+	_mm_lfence();
+	return __rdtsc();
+}
+
+static inline tsc_t end_rdtsc()
+{
+	// use rdtscp as well for similar reasons (plus it also tells us which
+	// core it was read from) we don't care about it in this case, since we
+	// expect this benchmark to be run with taskset to affinitize it to a core
+
+	unsigned int cpuNum;
+	unsigned long long tsc = __rdtscp(&cpuNum);
+	_mm_lfence();
+	return tsc;
+}
+
+// TSC ticks per second, for reporting in nanoseconds as well, see tsc_init().
+extern double tsc_hz;
+extern const char *tsc_hz_source;
+
+void tsc_init();
+
+static inline double tsc_to_ns(long double ticks)
+{
+	return ticks * 1e9 / tsc_hz;
+}
+
+/*
+ * HDR style log-linear histogram, so recording is O(1) in both time and
+ * memory no matter how many iterations are run.  Values below
+ * 2^HIST_SUB_BITS are kept exactly, larger ones in 2^(HIST_SUB_BITS-1)
+ * linear sub-buckets per power of two.  Reporting bucket midpoints keeps the
+ * relative error within 1/2^HIST_SUB_BITS (~0.8%).
+ */
+#define HIST_SUB_BITS 7
+#define HIST_HALF_COUNT (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+
+struct histogram
+{
+	uint64_t count;
+	tsc_t min;
+	tsc_t max;
+	long double sum;
+	long double sum_sq;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(struct histogram *h);
+
+static inline unsigned int hist_index(tsc_t value)
+{
+	if (value < (1ULL << HIST_SUB_BITS))
+	{
+		return value;
+	}
+	unsigned int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+	return shift * HIST_HALF_COUNT + (value >> shift);
+}
+
+static inline void hist_record(struct histogram *h, tsc_t value)
+{
+	h->buckets[hist_index(value)]++;
+	h->count++;
+	h->min = value < h->min ? value : h->min;
+	h->max = value > h->max ? value : h->max;
+	h->sum += value;
+	h->sum_sq += (long double)value * value;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src);
+// Value at percentile p (0-100), as the midpoint of its bucket clamped to
+// the exact min/max.
+tsc_t hist_percentile(const struct histogram *h, double p);
+void hist_avg_stddev(const struct histogram *h, long double *avg, long double *stddev);
+
+// Message sizes to run (-l, or a -w sweep), at least min_msg_size bytes.
+extern uint32_t msg_sizes[MAX_SWEEP_SIZES];
+extern int n_msg_sizes;
+extern bool sweep;
+extern long min_msg_size;
+
+// Accepts an optional K, M or G (binary) suffix, -1 if it doesn't parse or
+// overflows.
+long parse_size(const char *size_str, char **end);
+bool valid_msg_size(long size);
+int parse_sweep(const char *sweep_str);
+
+// Prints a run's summary: its initial connection/send and the stats of the
+// rest of its samples in h, or in sweeps one stats row per message size.
+void print_summary(uint32_t msg_size, tsc_t initial, const struct histogram *h);
+
+/*
+ * The run controller: --warmup runs untimed messages ahead of each message
+ * size (a count, or rounds of WARMUP_ROUND messages until that long has
+ * passed), then --trials times that many runs of it over the same
+ * connection instead of one.  The trials are merged for the summary, and
+ * their p50s and p99s bootstrapped for confidence intervals.  With
+ * --converge, trials stop early once both intervals are within that
+ * percentage of their estimate.
+ */
+#define WARMUP_ROUND 1000
+#define MAX_TRIALS 1000
+#define MIN_CONVERGE_TRIALS 5
+#define DEFAULT_CONVERGE_TRIALS 30
+
+extern unsigned int warmup_iterations;
+extern double warmup_sec;
+// Warmup samples aren't recorded anywhere.
+extern bool warming_up;
+extern unsigned int n_trials;
+extern double converge_pct;
+
+// Takes either a message count or a duration (eg: 2s or 500ms).
+int parse_warmup(const char *warmup_str);
+// Fills in the default n_trials once the options are parsed, -1 if they
+// don't add up.
+int trials_init();
+
+struct trial_series
+{
+	unsigned int n;
+	tsc_t initial;		// the first trial's
+	uint64_t iterations;
+	struct histogram hist;
+	tsc_t p50[MAX_TRIALS];
+	tsc_t p99[MAX_TRIALS];
+};
+
+void trials_reset(struct trial_series *s);
+void trials_add(struct trial_series *s, tsc_t initial, const struct histogram *h, unsigned int iterations);
+bool trials_converged(const struct trial_series *s);
+// The trials' mean p50 and p99 with their confidence intervals.
+void print_trials(uint32_t msg_size, const struct trial_series *s);
+
+/*
+ * Counters from perf_event_open() on the benchmark thread (--perf), to tie
+ * the latency stats to what the scheduler and the caches were up to
+ * meanwhile.  They're read around each run and, with --perf-outliers, around
+ * each sample as well, so the samples over that many ticks can be compared
+ * with the rest.  Counters the kernel (or the VM) doesn't offer are left out.
+ */
+enum perf_counter
+{
+	PERF_CONTEXT_SWITCHES,
+	PERF_CPU_MIGRATIONS,
+	PERF_PAGE_FAULTS,
+	PERF_CACHE_MISSES,
+	PERF_INSTRUCTIONS,
+	PERF_CYCLES,
+	N_PERF_COUNTERS,
+};
+
+extern bool perf_enabled;
+extern tsc_t perf_outlier_ticks;
+
+// Opens the counters on the calling thread, returning -1 if none could be.
+int perf_open();
+// Start and end a run, then print_perf() reports it per iteration.
+void perf_begin_run();
+void perf_end_run();
+void print_perf(uint32_t msg_size, unsigned int n);
+
+void perf_read_sample_begin();
+void perf_read_sample_end(tsc_t latency);
+
+// Around each sample (or batch), no-ops without --perf-outliers.
+static inline void perf_sample_begin()
+{
+	if (perf_outlier_ticks)
+	{
+		perf_read_sample_begin();
+	}
+}
+
+static inline void perf_sample_end(tsc_t latency)
+{
+	if (perf_outlier_ticks)
+	{
+		perf_read_sample_end(latency);
+	}
+}
+
+/*
+ * --timeline: besides the run's histogram, each sample also goes into one
+ * for its window, either timeline_window_ticks long (eg: 100ms) or
+ * timeline_window_samples samples, which is boiled down to a row (p50,
+ * p99, max, count and when the max happened) as the window closes.  The
+ * rows are printed after the run's summary, so periodic spikes (timer
+ * ticks, KSM scans, vhost scheduling) show up in time rather than averaged
+ * out.  Closing a window costs a few microseconds after the sample that
+ * closes it, which only the one-way server's next sample can pay for.
+ */
+struct timeline_window
+{
+	tsc_t start;
+	uint64_t count;
+	tsc_t p50;
+	tsc_t p99;
+	tsc_t max;
+	tsc_t max_tsc;		// when the max sample was recorded
+};
+
+extern bool timeline_enabled;
+extern tsc_t timeline_window_ticks;
+extern uint64_t timeline_window_samples;
+
+// Takes a duration (eg: 100ms or 1s) or a sample count.
+int parse_timeline(const char *window_str);
+void timeline_begin_run();
+void timeline_record_sample(tsc_t latency);
+// Prints the run's windows, closing the last.
+void print_timeline(uint32_t msg_size);
+
+static inline void timeline_record(tsc_t latency)
+{
+	if (timeline_enabled)
+	{
+		timeline_record_sample(latency);
+	}
+}
+
+/*
+ * Real-time setup of the benchmark thread ahead of timing, so setup noise
+ * stays out of the tails: --fifo runs it SCHED_FIFO at that priority,
+ * --mlock locks all memory (current and future) and --cpu pins it, warning
+ * if the cpu isn't isolated or isn't running the performance governor.
+ * The stack (and, with prefault(), the sample buffers) get faulted in up
+ * front either way.
+ */
+extern int rt_fifo_priority;	// 0 for none
+extern bool rt_mlock;
+extern int rt_cpu;		// -1 for none
+
+int rt_setup();
+void warn_cpu_tuning(int cpu);
+// Touches buf's pages now so their faults don't land in the samples.
+void prefault(void *buf, size_t len);
+
+#endif /* VSOCK_BENCH_H */
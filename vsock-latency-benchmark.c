@@ -37,230 +37,671 @@
  * the server processing the result).
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <linux/vm_sockets.h>
-#include <x86intrin.h>
 
-typedef unsigned long long tsc_t;
+#include "vsock-bench.h"
+#include "vsock-transport.h"
 
+// defaults, see -n, -p and -l
 #define ITERATIONS 1000
-#define SERVER_LISTEN_PORT 12345
-// variable for testing with different lengths (up to 4096)
 #define CLIENT_MESSAGE_LENGTH 32
+#define SERVER_UNIX_PATH "/tmp/vsock-latency-benchmark.sock"
+
+// Sent by the client ahead of each run of iterations so the server knows
+// what to expect.  A msg_size of 0 ends the session.
+#define RUN_HEADER_MARKER 0x726f756e64747268ULL
+#define RUN_FLAG_SWEEP 0x1
+// See --warmup and --trials: warmup runs aren't reported, trials are merged
+// until a header with TRIALS_DONE (and the number of trials as its
+// iterations) asks for their results.
+#define RUN_FLAG_WARMUP 0x2
+#define RUN_FLAG_TRIAL 0x4
+#define RUN_FLAG_TRIALS_DONE 0x8
+
+struct run_header
+{
+	uint64_t marker;
+	uint32_t msg_size;
+	uint32_t iterations;
+	uint32_t flags;
+	uint32_t reserved;
+};
 
-const char CLIENT_MESSAGE_BUFFER[CLIENT_MESSAGE_LENGTH] = {'c'};
 const char* SERVER_RESPONSE_MESSAGE = "s";
 const int SERVER_RESPONSE_LENGTH = 1;
-tsc_t ticks[ITERATIONS] = {0};
 
-#ifdef DEBUG
-#define DEBUG_PRINT(...) do{ fprintf( stderr, __VA_ARGS__ ); } while( false )
-#else
-#define DEBUG_PRINT(...) do{ } while ( false )
-#endif
+unsigned int iterations = ITERATIONS;
 
-void print_usage()
-{
-	fprintf(stderr, "%s\n", "usage: vsock-latency-benchmark <-s|-c server-cid>");
-}
+// Every header, message and ack is sent with a single write and read back
+// with its exact size, so the protocol works unchanged with seqpacket
+// sockets (see --sock-type).
+bool raw = false;
 
-inline tsc_t begin_rdtsc()
-{
-	// use lfence to prevent CPU reordering of the rdtsc instruction
-	// (instead of cpuid which is more heavyweight)
-	_mm_lfence();
-	return __rdtsc();
-}
+// Only kept with -r, to print them all.
+tsc_t *ticks;
 
-inline tsc_t end_rdtsc()
-{
-	// use rdtscp as well for similar reasons (plus it also tells us which
-	// core it was read from) we don't care about it in this case, since we
-	// expect this benchmark to be run with taskset to affinitize it to a core
-
-	unsigned int cpuNum; 
-	unsigned long long tsc = __rdtscp(&cpuNum);
-	_mm_lfence();
-	return tsc;
-}
+// The first sample of each run, left out of the histogram.
+tsc_t initial;
+struct histogram hist;
 
-int parse_cid(const char *cid_str)
-{
-	char *end = NULL;
-	long cid = strtol(cid_str, &end, 10);
-	if (cid_str != end && *end == '\0') {
-		return cid;
-	} else {
-		fprintf(stderr, "invalid cid: %s\n", cid_str);
-		return -1;
-	}
-}
+// The current message size's --trials.
+struct trial_series series;
 
-int vsock_listen_and_accept_single_client_connection()
+void print_usage(void)
 {
-	int listen_fd;
-	int client_fd;
+	fprintf(stderr, "%s\n",
+		"usage: vsock-latency-benchmark [options] <-s|-c <server-cid|unix-sock-path|ipaddr>>\n"
+		"  -m, --mode <mode>          vsock (default), unix (" SERVER_UNIX_PATH ")\n"
+		"                             or inet\n"
+		"  -p, --port <port>          vsock/inet port (default: 12345)\n"
+		"  -r, --raw                  also print every sample, not just the summary\n"
+		"      --recv-mode <mode>     wait for reads by blocking (default), epoll, or\n"
+		"                             busy polling with MSG_DONTWAIT and SO_BUSY_POLL\n"
+		"      --sock-type <type>     stream (default) or seqpacket (vsock/unix)\n"
+		"      --warmup <n|time>      untimed messages before each message size, a count\n"
+		"                             or a duration like 2s or 500ms (client only)\n"
+		"      --fifo <prio>          run SCHED_FIFO at that priority (1-99)\n"
+		"      --mlock                mlockall() current and future memory\n"
+		"      --cpu <n>              pin the benchmark thread to cpu n, warning if it\n"
+		"                             isn't isolated or uses a non-performance governor\n"
+		"      --perf                 count context switches, cpu migrations, page\n"
+		"                             faults, cache misses, instructions and cycles\n"
+		"                             (perf_event_open) and report them per iteration\n"
+		"      --perf-outliers <ticks> also per sample, comparing those over ticks with\n"
+		"                             the rest (implies --perf)\n"
+		"      --timeline <time|n>    also report p50, p99 and max per window of the\n"
+		"                             run, a duration like 100ms or 1s, or n samples\n"
+		"client only (the server follows the client's settings):\n"
+		"  -n, --iterations <n>       messages per message size (default: 1000)\n"
+		"  -l, --msg-size <bytes>     message size (default: 32)\n"
+		"  -w, --sweep <sizes>        run each of a list (8,100,1K) or the powers of two\n"
+		"                             in a range (8-64K) of message sizes over one\n"
+		"                             connection, printing a stats row per size\n"
+		"      --trials <m>           time m runs of each message size and report\n"
+		"                             their merged stats, with bootstrapped 95% CIs\n"
+		"                             for the p50 and p99 over the trials\n"
+		"      --converge <pct>       stop the trials once both CIs are within pct%\n"
+		"                             of their estimates (--trials is the most then,\n"
+		"                             default: 30)");
+}
 
-	struct sockaddr_vm sa_listen = {
-		.svm_family = AF_VSOCK,
-		.svm_cid = VMADDR_CID_ANY,
-		.svm_port = SERVER_LISTEN_PORT,
-	};
-	struct sockaddr_vm sa_client;
-	socklen_t socklen_client = sizeof(sa_client);
+void print_results(uint32_t msg_size, unsigned int n);
 
-	listen_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
-		return -1;
+static inline void record_sample(unsigned int i, tsc_t latency)
+{
+	if (warming_up)
+	{
+		return;
 	}
 
-	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
-		perror("bind");
-		close(listen_fd);
-		return -1;
+	if (i == 0)
+	{
+		initial = latency;
 	}
-
-	if (listen(listen_fd, 1) != 0) {
-		perror("listen");
-		close(listen_fd);
-		return -1;
+	else
+	{
+		hist_record(&hist, latency);
+		timeline_record(latency);
 	}
 
-	DEBUG_PRINT("%s\n", "Listening ...");
+	if (raw)
+	{
+		ticks[i] = latency;
+	}
+}
 
-	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
-	if (client_fd < 0) {
-		perror("accept");
-		close(listen_fd);
-		return -1;
+// Keeps room for a run's n samples with -r.  The counters cover all of a
+// size's trials together.
+void begin_run(unsigned int n, bool trial)
+{
+	hist_reset(&hist);
+	if (!trial || series.n == 0)
+	{
+		perf_begin_run();
+		timeline_begin_run();
 	}
+	if (raw && !warming_up)
+	{
+		ticks = realloc(ticks, n * sizeof(tsc_t));
+		if (!ticks)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		prefault(ticks, n * sizeof(tsc_t));
+	}
+}
 
-	fprintf(stderr, "Connection from cid %u port %u...\n", sa_client.svm_cid, sa_client.svm_port);
+// Adds the run just done to the series.
+void add_trial(uint32_t msg_size, unsigned int n)
+{
+	trials_add(&series, initial, &hist, n);
+	fprintf(stderr, "trial %u size %u: p50 %llu p99 %llu ticks\n",
+		series.n, msg_size, series.p50[series.n - 1], series.p99[series.n - 1]);
+}
 
-	close(listen_fd);
-	return client_fd;
+void print_series_results(uint32_t msg_size)
+{
+	memcpy(&hist, &series.hist, sizeof(hist));
+	initial = series.initial;
+	print_summary(msg_size, initial, &hist);
+	print_perf(msg_size, series.iterations);
+	print_timeline(msg_size);
+	print_trials(msg_size, &series);
+	trials_reset(&series);
 }
 
 void run_server()
 {
-	int client = vsock_listen_and_accept_single_client_connection();
-
-	for (int i=0; i < ITERATIONS; i++)
+	struct peer_id peer = { .name = "" };
+	int client = listen_and_accept_single_client_connection(transport, &peer);
+	if (client < 0 || recv_mode_setup(client) != 0)
 	{
-		// TODO? Use select()/epoll() and change the timer to only
-		// measure the time it takes to read/write after we get a
-		// notice that there's data available?
-		tsc_t begin_ts = begin_rdtsc();
+		exit(EXIT_FAILURE);
+	}
 
-		char buf[CLIENT_MESSAGE_LENGTH];
-		size_t bytes_read = read(client, buf, CLIENT_MESSAGE_LENGTH);
-		if (bytes_read <= 0)
+	char *buf = NULL;
+	trials_reset(&series);
+
+	for (;;)
+	{
+		struct run_header hdr;
+		if (read_full(client, &hdr, sizeof(hdr)) != 0)
 		{
 			perror("read");
 			exit(EXIT_FAILURE);
 		}
+		if (hdr.marker != RUN_HEADER_MARKER)
+		{
+			fprintf(stderr, "%s\n", "Unexpected run header from client (mismatched versions?).");
+			exit(EXIT_FAILURE);
+		}
+		if (hdr.msg_size == 0)
+		{
+			break;
+		}
+		if (hdr.msg_size > MAX_MESSAGE_LENGTH || hdr.iterations == 0)
+		{
+			fprintf(stderr, "Invalid run header (msg_size: %u, iterations: %u).\n", hdr.msg_size, hdr.iterations);
+			exit(EXIT_FAILURE);
+		}
+		sweep = hdr.flags & RUN_FLAG_SWEEP;
+		if (hdr.flags & RUN_FLAG_TRIALS_DONE)
+		{
+			if (series.n != hdr.iterations)
+			{
+				fprintf(stderr, "Client ran %u trials, we saw %u.\n", hdr.iterations, series.n);
+				exit(EXIT_FAILURE);
+			}
+			print_series_results(hdr.msg_size);
+			continue;
+		}
+		warming_up = hdr.flags & RUN_FLAG_WARMUP;
+		bool trial = hdr.flags & RUN_FLAG_TRIAL;
 
-		DEBUG_PRINT("Server received %lu bytes ('%s') at iteration %d.\n", bytes_read, buf, i);
-
-		if (write(client, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) <= 0)
+		// Ack the header so the first timed message isn't held back
+		// behind it (eg: by Nagle for inet).
+		if (write(client, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) != SERVER_RESPONSE_LENGTH)
 		{
 			perror("write");
 			exit(EXIT_FAILURE);
 		}
 
-		ticks[i] = end_rdtsc() - begin_ts;
+		buf = realloc(buf, hdr.msg_size);
+		if (!buf)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		begin_run(hdr.iterations, trial);
+
+		for (unsigned int i=0; i < hdr.iterations; i++)
+		{
+			perf_sample_begin();
+
+			// With epoll or busy reads only time the read/respond once
+			// the message is there (blocking reads also count the wait).
+			if (recv_wait(client) != 0)
+			{
+				perror("recv_wait");
+				exit(EXIT_FAILURE);
+			}
+			tsc_t begin_ts = begin_rdtsc();
+
+			if (read_full(client, buf, hdr.msg_size) != 0)
+			{
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+
+			DEBUG_PRINT("Server received %u bytes at iteration %u.\n", hdr.msg_size, i);
+
+			if (write(client, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) <= 0)
+			{
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+
+			tsc_t latency = end_rdtsc() - begin_ts;
+			record_sample(i, latency);
+			perf_sample_end(latency);
+		}
+		perf_end_run();
+
+		if (trial)
+		{
+			add_trial(hdr.msg_size, hdr.iterations);
+		}
+		else if (!warming_up)
+		{
+			print_results(hdr.msg_size, hdr.iterations);
+		}
 	}
+
+	free(buf);
 }
 
-int vsock_connect(const char *cid_str)
+// Starts a run of n messages of msg_size (waiting for the server's ack,
+// except for the end of a series of trials, which it doesn't ack).
+void start_run(int server, uint32_t msg_size, unsigned int n, uint32_t flags)
 {
-	int fd;
-	int cid;
-	struct sockaddr_vm sa = {
-		.svm_family = AF_VSOCK,
-		.svm_port = SERVER_LISTEN_PORT,
+	struct run_header hdr = {
+		.marker = RUN_HEADER_MARKER,
+		.msg_size = msg_size,
+		.iterations = n,
+		.flags = flags | (sweep ? RUN_FLAG_SWEEP : 0),
 	};
-
-	cid = parse_cid(cid_str);
-	if (cid < 0) {
-		return -1;
+	if (write_full(server, &hdr, sizeof(hdr)) != 0)
+	{
+		perror("write");
+		exit(EXIT_FAILURE);
 	}
-	sa.svm_cid = cid;
-
-	fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (fd < 0) {
-		perror("socket");
-		return -1;
+	if (flags & RUN_FLAG_TRIALS_DONE)
+	{
+		return;
 	}
-
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-		perror("connect");
-		close(fd);
-		return -1;
+	char ack;
+	if (read_full(server, &ack, sizeof(ack)) != 0)
+	{
+		perror("read");
+		exit(EXIT_FAILURE);
 	}
-
-	return fd;
 }
 
-void run_client(const char* server_cid)
+void run_messages(int server, char *msg, uint32_t msg_size, unsigned int n)
 {
-	int server = vsock_connect(server_cid);
-
-	for (int i=0; i<ITERATIONS; i++)
+	for (unsigned int i=0; i<n; i++)
 	{
+		perf_sample_begin();
 		tsc_t begin_ts = begin_rdtsc();
 
-		if (write(server, CLIENT_MESSAGE_BUFFER, CLIENT_MESSAGE_LENGTH) != CLIENT_MESSAGE_LENGTH)
+		if (write_full(server, msg, msg_size) != 0)
 		{
 			perror("write");
 			exit(EXIT_FAILURE);
 		}
 
 		char buf[SERVER_RESPONSE_LENGTH];
-		size_t bytes_read = read(server, buf, SERVER_RESPONSE_LENGTH);
+		ssize_t bytes_read = recv_some(server, buf, SERVER_RESPONSE_LENGTH);
 		if (bytes_read <= 0)
 		{
 			perror("read");
 			exit(EXIT_FAILURE);
 		}
 
-		DEBUG_PRINT("Client received %lu bytes ('%s') at iteration %d.\n", bytes_read, buf, i);
+		DEBUG_PRINT("Client received %lu bytes ('%c') at iteration %u.\n", bytes_read, buf[0], i);
 
-		ticks[i] = end_rdtsc() - begin_ts;
+		tsc_t latency = end_rdtsc() - begin_ts;
+		record_sample(i, latency);
+		perf_sample_end(latency);
 	}
 }
 
-void print_results()
+// Untimed runs ahead of a message size's trials, of warmup_iterations
+// messages or as many WARMUP_ROUNDs as fit in warmup_sec.
+void run_warmup(int server, char *msg, uint32_t msg_size)
 {
-	for (int i=0; i<ITERATIONS; i++)
+	unsigned int n = warmup_iterations ? warmup_iterations : WARMUP_ROUND;
+	tsc_t start = begin_rdtsc();
+
+	warming_up = true;
+	do
+	{
+		start_run(server, msg_size, n, RUN_FLAG_WARMUP);
+		run_messages(server, msg, msg_size, n);
+	} while (warmup_sec > 0 && (begin_rdtsc() - start) / tsc_hz < warmup_sec);
+	warming_up = false;
+}
+
+void run_client(const char* server_arg)
+{
+	int server = transport->connect(server_arg);
+	if (server < 0 || recv_mode_setup(server) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t max_size = 0;
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		max_size = msg_sizes[j] > max_size ? msg_sizes[j] : max_size;
+	}
+
+	char *msg = malloc(max_size);
+	if (!msg)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(msg, 'c', max_size);
+
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		uint32_t msg_size = msg_sizes[j];
+		if (warmup_iterations > 0 || warmup_sec > 0)
+		{
+			run_warmup(server, msg, msg_size);
+		}
+
+		if (n_trials > 1)
+		{
+			trials_reset(&series);
+			while (series.n < n_trials && !trials_converged(&series))
+			{
+				start_run(server, msg_size, iterations, RUN_FLAG_TRIAL);
+				begin_run(iterations, true);
+				run_messages(server, msg, msg_size, iterations);
+				perf_end_run();
+				add_trial(msg_size, iterations);
+			}
+			start_run(server, msg_size, series.n, RUN_FLAG_TRIALS_DONE);
+			print_series_results(msg_size);
+			continue;
+		}
+
+		start_run(server, msg_size, iterations, 0);
+		begin_run(iterations, false);
+		run_messages(server, msg, msg_size, iterations);
+		perf_end_run();
+
+		print_results(msg_size, iterations);
+	}
+
+	struct run_header end = {
+		.marker = RUN_HEADER_MARKER,
+	};
+	if (write_full(server, &end, sizeof(end)) != 0)
 	{
-		fprintf(stdout, "%4d: %llu\n", i, ticks[i]);
+		perror("write");
+		exit(EXIT_FAILURE);
 	}
+
+	free(msg);
 }
 
-int main(int argc, char** argv)
+// Summary of the samples (leaving out the first as the initial
+// connection/send), or one stats row per size in sweeps.  -r adds a dump of
+// every sample.
+void print_results(uint32_t msg_size, unsigned int n)
 {
-	if (argc == 2 && strcmp(argv[1], "-s") == 0)
+	if (raw)
 	{
-		run_server();
+		for (unsigned int i=0; i<n; i++)
+		{
+			fprintf(stdout, "%4u: %llu (%.1f ns)\n", i, ticks[i], tsc_to_ns(ticks[i]));
+		}
 	}
-	else if (argc == 3 && strcmp(argv[1], "-c") == 0)
+
+	print_summary(msg_size, initial, &hist);
+	print_perf(msg_size, n);
+	print_timeline(msg_size);
+}
+
+// Long-only options.
+enum
+{
+	OPT_RECV_MODE = 256,
+	OPT_SOCK_TYPE,
+	OPT_PERF,
+	OPT_PERF_OUTLIERS,
+	OPT_WARMUP,
+	OPT_TRIALS,
+	OPT_CONVERGE,
+	OPT_FIFO,
+	OPT_MLOCK,
+	OPT_CPU,
+	OPT_TIMELINE,
+};
+
+int main(int argc, char** argv)
+{
+	static const struct option long_options[] = {
+		{ "mode", required_argument, NULL, 'm' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "msg-size", required_argument, NULL, 'l' },
+		{ "sweep", required_argument, NULL, 'w' },
+		{ "raw", no_argument, NULL, 'r' },
+		{ "recv-mode", required_argument, NULL, OPT_RECV_MODE },
+		{ "sock-type", required_argument, NULL, OPT_SOCK_TYPE },
+		{ "perf", no_argument, NULL, OPT_PERF },
+		{ "perf-outliers", required_argument, NULL, OPT_PERF_OUTLIERS },
+		{ "warmup", required_argument, NULL, OPT_WARMUP },
+		{ "trials", required_argument, NULL, OPT_TRIALS },
+		{ "converge", required_argument, NULL, OPT_CONVERGE },
+		{ "fifo", required_argument, NULL, OPT_FIFO },
+		{ "mlock", no_argument, NULL, OPT_MLOCK },
+		{ "cpu", required_argument, NULL, OPT_CPU },
+		{ "timeline", required_argument, NULL, OPT_TIMELINE },
+		{ NULL, 0, NULL, 0 },
+	};
+	bool server = false;
+	const char *server_arg = NULL;
+	int opt;
+
+	msg_sizes[0] = CLIENT_MESSAGE_LENGTH;
+	server_unix_path = SERVER_UNIX_PATH;
+
+	while ((opt = getopt_long(argc, argv, "m:sc:p:n:l:w:r", long_options, NULL)) != -1)
 	{
-		run_client(argv[2]);
+		char *end;
+		long size;
+
+		switch (opt)
+		{
+			case 'm':
+				if (strcmp(optarg, "vsock") == 0)
+				{
+					transport = &vsock_transport;
+				}
+				else if (strcmp(optarg, "unix") == 0)
+				{
+					transport = &unix_transport;
+				}
+				else if (strcmp(optarg, "inet") == 0)
+				{
+					transport = &inet_transport;
+				}
+				else
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				server = true;
+				break;
+			case 'c':
+				server_arg = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				if (port <= 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				iterations = strtoul(optarg, &end, 10);
+				if (*end != '\0' || iterations == 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'l':
+				size = parse_size(optarg, &end);
+				if (*end != '\0' || !valid_msg_size(size))
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				msg_sizes[0] = size;
+				n_msg_sizes = 1;
+				sweep = false;
+				break;
+			case 'w':
+				if (parse_sweep(optarg) != 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				sweep = true;
+				break;
+			case 'r':
+				raw = true;
+				break;
+			case OPT_SOCK_TYPE:
+				if (parse_sock_type(optarg) != 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_RECV_MODE:
+				if (parse_recv_mode(optarg) != 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_WARMUP:
+				if (parse_warmup(optarg) != 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_TRIALS:
+				n_trials = strtoul(optarg, &end, 10);
+				if (*end != '\0' || n_trials == 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_CONVERGE:
+				converge_pct = strtod(optarg, &end);
+				if (*end != '\0' || converge_pct <= 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_FIFO:
+				rt_fifo_priority = strtol(optarg, &end, 10);
+				if (*end != '\0' || rt_fifo_priority < 1 || rt_fifo_priority > 99)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_MLOCK:
+				rt_mlock = true;
+				break;
+			case OPT_CPU:
+				rt_cpu = strtol(optarg, &end, 10);
+				if (*end != '\0' || rt_cpu < 0 || rt_cpu >= CPU_SETSIZE)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_TIMELINE:
+				if (parse_timeline(optarg) != 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_PERF:
+				perf_enabled = true;
+				break;
+			case OPT_PERF_OUTLIERS:
+				perf_outlier_ticks = strtoull(optarg, &end, 10);
+				if (*end != '\0' || perf_outlier_ticks == 0)
+				{
+					print_usage();
+					return EXIT_FAILURE;
+				}
+				perf_enabled = true;
+				break;
+			default:
+				print_usage();
+				return EXIT_FAILURE;
+		}
 	}
-	else
+
+	if (optind != argc || server == (server_arg != NULL) ||
+	    (sock_type != SOCK_STREAM && transport == &inet_transport))
 	{
 		print_usage();
 		return EXIT_FAILURE;
 	}
+	if (trials_init() != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (raw && n_trials > 1)
+	{
+		fprintf(stderr, "%s\n", "--trials doesn't print -r samples.");
+		return EXIT_FAILURE;
+	}
+
+	tsc_init();
+	if (rt_setup() != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (perf_enabled && perf_open() != 0)
+	{
+		return EXIT_FAILURE;
+	}
 
-	print_results();
+	if (server)
+	{
+		run_server();
+		if (transport == &unix_transport)
+		{
+			unlink(SERVER_UNIX_PATH);
+		}
+	}
+	else
+	{
+		run_client(server_arg);
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -35,61 +35,143 @@
  * we're going to go ahead and try that approach anyways!
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <linux/futex.h>
 #include <linux/vm_sockets.h>
 #include <x86intrin.h>
+#include <cpuid.h>
 #include <math.h>
 #include <limits.h>
 
-typedef unsigned long long tsc_t;
+#include "vsock-bench.h"
+#include "vsock-transport.h"
 
+// defaults, see -n, -p and -l
 #define ITERATIONS 1000000
-#define SERVER_LISTEN_PORT 12345
 #define SERVER_UNIX_PATH "/tmp/vsock-oneway-latency-benchmark.sock"
-
-// TODO: variable for testing with different lengths (up to 4096)
-#define CLIENT_MESSAGE_LENGTH 32
-//#define CLIENT_MESSAGE_LENGTH 4096
+#define SERVER_SHM_PATH "/dev/shm/vsock-oneway-latency-benchmark"
+#define SERVER_PIPE_PATH "/tmp/vsock-oneway-latency-benchmark.pipe"
+#define CLIENT_MESSAGE_LENGTH 8
+
+#define MAX_BATCH_SIZE 1024
+
+// Sent by the client ahead of each run of iterations so the server knows
+// what to expect.  A msg_size of 0 ends the session.
+#define RUN_HEADER_MARKER 0x6f6e657761796864ULL
+
+#define RUN_FLAG_SWEEP 0x1
+#define RUN_FLAG_TRACE 0x2
+// See --warmup and --trials: warmup runs aren't reported, trials are merged
+// until a header with TRIALS_DONE (and the number of trials as its
+// iterations) asks for their results.
+#define RUN_FLAG_WARMUP 0x4
+#define RUN_FLAG_TRIAL 0x8
+#define RUN_FLAG_TRIALS_DONE 0x10
+
+struct run_header
+{
+	uint64_t marker;
+	uint32_t msg_size;
+	uint32_t iterations;
+	uint32_t flags;
+	uint32_t batch;		// messages per send, 0 is taken as 1
+};
 
 const char* SERVER_RESPONSE_MESSAGE = "s";
 const int SERVER_RESPONSE_LENGTH = 1;
-tsc_t ticks[ITERATIONS] = {0};
 
-#ifdef DEBUG
-#define DEBUG_PRINT(...) do{ fprintf( stderr, __VA_ARGS__ ); } while( false )
-#else
-#define DEBUG_PRINT(...) do{ } while ( false )
-#endif
+unsigned int iterations = ITERATIONS;
 
-inline tsc_t begin_rdtsc()
-{
-	// use lfence to prevent CPU reordering of the rdtsc instruction
-	// (instead of cpuid which is more heavyweight)
-	_mm_lfence();
-	return __rdtsc();
-}
+// --churn: connect, send one message and close this many times instead of
+// timing messages over one connection.
+unsigned int churn_cycles = 0;
+
+bool raw = false;
+bool raw_print = false;
+
+// Only kept with -r (to print them all) or --raw-file.
+tsc_t *ticks;
+
+// Messages per send syscall (-b), and the time those syscalls took (the
+// client's sends, the server's reads).
+unsigned int batch_size = 1;
+__thread struct histogram syscall_hist;
 
-inline tsc_t end_rdtsc()
+/*
+ * --trace: breaks each message's round trip down into the stages between
+ * the client's pre-write, post-write and ack-received timestamps and the
+ * server's wakeup (recv_wait() returning), post-read and pre-ack ones.  The
+ * server sends its timestamps back as the ack, already moved into the
+ * client's tsc by the tsc-offset, and the client keeps a histogram per
+ * stage.  Blocking reads have no separate wakeup, so trace runs poll() for
+ * the message first there, see trace_wait().
+ */
+struct trace_reply
 {
-	// use rdtscp as well for similar reasons (plus it also tells us which
-	// core it was read from) we don't care about it in this case, since we
-	// expect this benchmark to be run with taskset to affinitize it to a core
+	tsc_t wakeup;
+	tsc_t read_end;
+	tsc_t ack_begin;
+};
 
-	unsigned int cpuNum;
-	unsigned long long tsc = __rdtscp(&cpuNum);
-	_mm_lfence();
-	return tsc;
-}
+enum trace_stage
+{
+	TRACE_CLIENT_WRITE,
+	TRACE_TO_WAKEUP,
+	TRACE_SERVER_READ,
+	TRACE_SERVER_TO_ACK,
+	TRACE_ACK_RETURN,
+	N_TRACE_STAGES,
+};
+
+const char *trace_stage_names[N_TRACE_STAGES] = {
+	[TRACE_CLIENT_WRITE] = "client-write",
+	[TRACE_TO_WAKEUP] = "to-server-wakeup",
+	[TRACE_SERVER_READ] = "server-read",
+	[TRACE_SERVER_TO_ACK] = "server-to-ack",
+	[TRACE_ACK_RETURN] = "ack-return",
+};
+
+bool trace = false;
+// The current run's N_TRACE_STAGES histograms.
+struct histogram *trace_hists;
+// Stages that came out negative and were recorded as 0: the server waking
+// up before the client's write returned, or the clocks disagreeing by more
+// than the stage took.
+unsigned long n_trace_clamped = 0;
+
+// Open-loop (--rate) client settings, 0 for the default closed loop.
+double target_rate = 0;
+unsigned int max_inflight = 64;
+
+// The first sample of each run, left out of the histogram.  Per thread so
+// each -t client thread records on its own.
+__thread tsc_t initial;
+__thread struct histogram hist;
 
 long long parse_client_tsc_offset(const char *client_tsc_offset_str)
 {
@@ -103,460 +185,2778 @@ long long parse_client_tsc_offset(const char *client_tsc_offset_str)
 	}
 }
 
-int parse_cid(const char *cid_str)
-{
-	char *end = NULL;
-	long cid = strtol(cid_str, &end, 10);
-	if (cid_str != end && *end == '\0') {
-		return cid;
-	} else {
-		fprintf(stderr, "invalid cid: %s\n", cid_str);
-		return -1;
-	}
-}
+// With -s auto, the server looks up each vsock client's tsc-offset in
+// debugfs itself, so several VMs can run at once.
+bool auto_tsc_offset = false;
 
-int vsock_listen_and_accept_single_client_connection()
-{
-	int listen_fd;
-	int client_fd;
+#define KVM_DEBUGFS_DIR "/sys/kernel/debug/kvm"
 
-	struct sockaddr_vm sa_listen = {
-		.svm_family = AF_VSOCK,
-		.svm_cid = VMADDR_CID_ANY,
-		.svm_port = SERVER_LISTEN_PORT,
-	};
-	struct sockaddr_vm sa_client;
-	socklen_t socklen_client = sizeof(sa_client);
+// Reads the tsc-offset of the VM in debugfs whose VMM is pid (its
+// directories are named <pid>-<vm fd>), returning -1 if there isn't one.
+int read_vm_tsc_offset(long pid, long long *offset)
+{
+	char pattern[PATH_MAX];
+	glob_t paths;
 
-	listen_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
+	snprintf(pattern, sizeof(pattern), "%s/%ld-*/vcpu*/tsc-offset", KVM_DEBUGFS_DIR, pid);
+	if (glob(pattern, 0, NULL, &paths) != 0)
+	{
 		return -1;
 	}
 
-	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
-		perror("bind");
-		close(listen_fd);
-		return -1;
+	int ret = -1;
+	for (size_t i=0; i<paths.gl_pathc; i++)
+	{
+		long long vcpu_offset;
+		FILE *f = fopen(paths.gl_pathv[i], "r");
+		if (!f)
+		{
+			perror(paths.gl_pathv[i]);
+			continue;
+		}
+		if (fscanf(f, "%lld", &vcpu_offset) == 1)
+		{
+			if (ret == 0 && vcpu_offset != *offset)
+			{
+				fprintf(stderr, "warning: %s differs from the first vcpu (%lld vs %lld), using the first.\n",
+					paths.gl_pathv[i], vcpu_offset, *offset);
+			}
+			else if (ret != 0)
+			{
+				*offset = vcpu_offset;
+				ret = 0;
+			}
+		}
+		fclose(f);
 	}
+	globfree(&paths);
+	return ret;
+}
 
-	if (listen(listen_fd, 1) != 0) {
-		perror("listen");
-		close(listen_fd);
+// Finds the VMM (eg: qemu) process whose command line gives the vhost-vsock
+// device guest-cid=cid, returning -1 if there isn't one.
+long vmm_pid_for_cid(unsigned int cid)
+{
+	char needle[32];
+	snprintf(needle, sizeof(needle), "guest-cid=%u", cid);
+	size_t needle_len = strlen(needle);
+
+	DIR *proc = opendir("/proc");
+	if (!proc)
+	{
+		perror("/proc");
 		return -1;
 	}
 
-	DEBUG_PRINT("%s\n", "Listening on vsock VMADDR_CID_ANY (2 for the host) ...");
+	long found = -1;
+	struct dirent *de;
+	while (found < 0 && (de = readdir(proc)) != NULL)
+	{
+		char *end;
+		long pid = strtol(de->d_name, &end, 10);
+		if (end == de->d_name || *end != '\0')
+		{
+			continue;
+		}
+
+		char path[64];
+		char cmdline[8192];
+		snprintf(path, sizeof(path), "/proc/%ld/cmdline", pid);
+		FILE *f = fopen(path, "r");
+		if (!f)
+		{
+			continue;
+		}
+		size_t len = fread(cmdline, 1, sizeof(cmdline) - 1, f);
+		fclose(f);
+		cmdline[len] = '\0';
 
-	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
-	if (client_fd < 0) {
-		perror("accept");
-		close(listen_fd);
-		return -1;
+		// The args are NUL separated, and the cid may be followed by
+		// further ,key=value device properties.
+		for (char *arg = cmdline; arg < cmdline + len; arg += strlen(arg) + 1)
+		{
+			char *match = strstr(arg, needle);
+			if (match && (match[needle_len] == '\0' || match[needle_len] == ','))
+			{
+				found = pid;
+				break;
+			}
+		}
 	}
+	closedir(proc);
+	return found;
+}
 
-	int host_vm_id;
-	socklen_t host_vm_id_size = sizeof(host_vm_id);
-	if (getsockopt(client_fd, SOL_SOCKET, SO_VM_SOCKETS_PEER_HOST_VM_ID, (void *)&host_vm_id, &host_vm_id_size) != 0)
+// Resolves the tsc-offset for a vsock peer, trying its host VM id (where the
+// transport reports one) as the VMM pid first and then the VMM with that
+// guest-cid.
+int resolve_tsc_offset(const struct peer_id *peer, long long *offset)
+{
+	if (peer->host_vm_id > 0 && read_vm_tsc_offset(peer->host_vm_id, offset) == 0)
 	{
-		perror("getsockopt");
-		close(client_fd);
-		close(listen_fd);
-		return -1;
+		fprintf(stderr, "%s: tsc-offset %lld (vm id)\n", peer->name, *offset);
+		return 0;
 	}
 
-	fprintf(stderr, "Connection from cid %u (id: %d, size: %u) port %u...\n", sa_client.svm_cid, host_vm_id, host_vm_id_size, sa_client.svm_port);
+	long pid = vmm_pid_for_cid(peer->cid);
+	if (pid > 0 && read_vm_tsc_offset(pid, offset) == 0)
+	{
+		fprintf(stderr, "%s: tsc-offset %lld (pid %ld)\n", peer->name, *offset, pid);
+		return 0;
+	}
 
-	close(listen_fd);
-	return client_fd;
+	fprintf(stderr, "%s: couldn't find a tsc-offset under %s (is debugfs mounted, and are we root?)\n",
+		peer->name, KVM_DEBUGFS_DIR);
+	return -1;
 }
 
-int unix_listen_and_accept_single_client_connection()
+/*
+ * With -s sync, the server estimates the tsc-offset in-band instead, NTP
+ * style, over the benchmark connection itself, so it works over any
+ * transport (eg: inet to a remote host) and without debugfs.  Ahead of
+ * each run it answers the header with SYNC_REQUEST_MESSAGE followed by
+ * SYNC_PROBES probes, each carrying its send time, which the client stamps
+ * with its own tsc and sends straight back, and then the header's usual
+ * ack.  The probe that made it back the quickest bounds the offset the
+ * tightest: the offset is within half its round trip of the client's
+ * stamp minus the probe's midpoint.  Later runs' estimates against the
+ * first give the drift (the longer apart, the less the error bounds
+ * matter), which is extrapolated over each run.
+ */
+#define SYNC_PROBES 256
+
+const char* SYNC_REQUEST_MESSAGE = "y";
+
+struct sync_probe
 {
-	int listen_fd;
-	int client_fd;
+	uint32_t remaining;	// probes after this one
+	uint32_t reserved;
+	tsc_t server_tsc;
+	tsc_t client_tsc;
+};
 
-	struct sockaddr_un sa_listen = {
-		.sun_family = AF_UNIX,
-	};
-	strncpy(sa_listen.sun_path, SERVER_UNIX_PATH, sizeof(sa_listen.sun_path)-1);
-	struct sockaddr_vm sa_client;
-	socklen_t socklen_client = sizeof(sa_client);
+struct clock_sync
+{
+	int n;			// estimates so far
+	long long offset;	// as of at
+	tsc_t at;
+	long long first_offset;
+	tsc_t first_at;
+	tsc_t min_rtt;
+	double drift;		// offset ticks per server tick
+};
+
+bool sync_tsc_offset = false;
+struct clock_sync clock_sync;
+
+// The client's side of a sync, after its SYNC_REQUEST_MESSAGE.
+int answer_sync(int fd)
+{
+	struct sync_probe probe;
+	do
+	{
+		if (read_full(fd, &probe, sizeof(probe)) != 0)
+		{
+			return -1;
+		}
+		probe.client_tsc = begin_rdtsc();
+		if (write_full(fd, &probe, sizeof(probe)) != 0)
+		{
+			return -1;
+		}
+	} while (probe.remaining > 0);
+	return 0;
+}
 
-	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
+int sync_clock(int fd)
+{
+	if (write_full(fd, SYNC_REQUEST_MESSAGE, strlen(SYNC_REQUEST_MESSAGE)) != 0)
+	{
 		return -1;
 	}
 
-	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
-		perror("bind");
-		close(listen_fd);
-		return -1;
+	tsc_t min_rtt = ULLONG_MAX;
+	long long offset = 0;
+	tsc_t at = 0;
+	for (int k=0; k<SYNC_PROBES; k++)
+	{
+		struct sync_probe probe = {
+			.remaining = SYNC_PROBES - 1 - k,
+			.server_tsc = begin_rdtsc(),
+		};
+		if (write_full(fd, &probe, sizeof(probe)) != 0 || read_full(fd, &probe, sizeof(probe)) != 0)
+		{
+			return -1;
+		}
+		tsc_t received = end_rdtsc();
+		tsc_t rtt = received - probe.server_tsc;
+		if (rtt < min_rtt)
+		{
+			min_rtt = rtt;
+			at = probe.server_tsc + rtt / 2;
+			offset = (long long)(probe.client_tsc - at);
+		}
 	}
 
-	if (listen(listen_fd, 1) != 0) {
-		perror("listen");
-		close(listen_fd);
-		return -1;
+	struct clock_sync *cs = &clock_sync;
+	if (cs->n == 0)
+	{
+		cs->first_offset = offset;
+		cs->first_at = at;
 	}
-
-	DEBUG_PRINT("Listening at '%s' ...", SERVER_UNIX_PATH);
-
-	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
-	if (client_fd < 0) {
-		perror("accept");
-		close(listen_fd);
-		return -1;
+	else if (at > cs->first_at)
+	{
+		cs->drift = (double)(offset - cs->first_offset) / (at - cs->first_at);
 	}
+	cs->offset = offset;
+	cs->at = at;
+	cs->min_rtt = min_rtt;
+	cs->n++;
+
+	fprintf(stderr, "sync: tsc-offset %lld +/- %llu ticks (+/- %.1f ns, min rtt over %d probes), drift %.3f ppm\n",
+		offset, min_rtt / 2, tsc_to_ns(min_rtt / 2), SYNC_PROBES, cs->drift * 1e6);
+	return write_full(fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH);
+}
 
-	fprintf(stderr, "%s\n", "Connection from ... (not sure how to get the remote peer details offhand ...");
-
-	close(listen_fd);
-	return client_fd;
+// The synced offset for a sample taken at now.
+static inline long long synced_offset(tsc_t now)
+{
+	return clock_sync.offset + (long long)(clock_sync.drift * ((double)now - (double)clock_sync.at));
 }
 
-int inet_listen_and_accept_single_client_connection()
+/*
+ * Baselines that skip the socket layer: -m pipe is a pair of FIFOs, and
+ * -m shm a pair of lock-free single-producer/single-consumer byte rings in
+ * a shared mapping, waited on by spinning (--recv-mode busy) or with a
+ * futex (the default).
+ */
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_MAGIC "VSOCKSHM"
+
+struct shm_ring
+{
+	// Free running positions, each written by one side only.  A side
+	// about to sleep on the other's position sets its waiters flag so
+	// that the other knows to FUTEX_WAKE it.
+	uint32_t head __attribute__((aligned(64)));	// consumer
+	uint32_t head_waiters;
+	uint32_t tail __attribute__((aligned(64)));	// producer
+	uint32_t tail_waiters;
+	char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct shm_region
 {
-	int listen_fd;
-	int client_fd;
+	char magic[8];
+	struct shm_ring to_server;
+	struct shm_ring to_client;
+};
 
-	struct sockaddr_in sa_listen = {
-		.sin_family = AF_INET,
-		// Listen on all addrs so we can test both from loopback and across the network.
-		.sin_addr.s_addr = INADDR_ANY,
-		.sin_port = htons(SERVER_LISTEN_PORT),
-	};
-	struct sockaddr_in sa_client;
-	socklen_t socklen_client = sizeof(sa_client);
+struct shm_region *shm_region;
+struct shm_ring *shm_rx;
+struct shm_ring *shm_tx;
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
-		return -1;
-	}
+int pipe_write_fd = -1;
 
-	// Forcefully attaching socket to port
-	int opt = 1;
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
-	{
-		perror("setsockopt");
-		exit(EXIT_FAILURE);
+// Waits for *pos (the other side's position) to move on from old.
+void shm_wait_pos(uint32_t *pos, uint32_t *waiters, uint32_t old)
+{
+	if (recv_mode == RECV_BUSY) {
+		while (__atomic_load_n(pos, __ATOMIC_ACQUIRE) == old) {
+			_mm_pause();
+		}
+		return;
 	}
 
-	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
-		perror("bind");
-		close(listen_fd);
-		return -1;
+	__atomic_store_n(waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == old) {
+		syscall(SYS_futex, pos, FUTEX_WAIT, old, NULL, NULL, 0);
 	}
+	__atomic_store_n(waiters, 0, __ATOMIC_SEQ_CST);
+}
 
-	if (listen(listen_fd, 1) != 0) {
-		perror("listen");
-		close(listen_fd);
-		return -1;
+// Publishes our new position, waking the other side if it's asleep on it.
+void shm_set_pos(uint32_t *pos, uint32_t *waiters, uint32_t new_pos)
+{
+	__atomic_store_n(pos, new_pos, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+		syscall(SYS_futex, pos, FUTEX_WAKE, 1, NULL, NULL, 0);
 	}
+}
 
-	DEBUG_PRINT("Listening on inet '0.0.0.0' at port '%d' ...", SERVER_LISTEN_PORT);
+int shm_wait(int fd)
+{
+	struct shm_ring *r = shm_rx;
+	uint32_t head = r->head;
+	if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+		shm_wait_pos(&r->tail, &r->tail_waiters, head);
+	}
+	return 0;
+}
 
-	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
-	if (client_fd < 0) {
-		perror("accept");
-		close(listen_fd);
-		return -1;
+ssize_t shm_recv(int fd, void *buf, size_t len)
+{
+	struct shm_ring *r = shm_rx;
+	uint32_t head = r->head;
+	uint32_t avail;
+	while ((avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head) == 0) {
+		shm_wait_pos(&r->tail, &r->tail_waiters, head);
 	}
 
-	fprintf(stderr, "Connection from client address '%s' at port %u ...\n", inet_ntoa(sa_client.sin_addr), ntohs(sa_client.sin_port));
+	size_t n = len < avail ? len : avail;
+	size_t off = head % SHM_RING_SIZE;
+	size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+	memcpy(buf, r->data + off, first);
+	memcpy((char *)buf + first, r->data, n - first);
 
-	close(listen_fd);
-	return client_fd;
+	shm_set_pos(&r->head, &r->head_waiters, head + n);
+	return n;
 }
 
-
-void run_server(int client_sock_fd, long long client_tsc_offset)
+ssize_t shm_send(int fd, const void *buf, size_t len)
 {
-	DEBUG_PRINT("Server using tsc-offset of %lld.\n", client_tsc_offset);
+	struct shm_ring *r = shm_tx;
+	uint32_t tail = r->tail;
+	uint32_t space;
+	while ((space = SHM_RING_SIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))) == 0) {
+		shm_wait_pos(&r->head, &r->head_waiters, tail - SHM_RING_SIZE);
+	}
 
-	for (int i=0; i<ITERATIONS; i++)
-	{
-		// TODO? Use select()/epoll() and change the timer to only
-		// measure the time it takes to read/write after we get a
-		// notice that there's data available?
+	size_t n = len < space ? len : space;
+	size_t off = tail % SHM_RING_SIZE;
+	size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const char *)buf + first, n - first);
 
-		tsc_t client_send_tsc;
-		size_t bytes_read = read(client_sock_fd, &client_send_tsc, sizeof(client_send_tsc));
-		if (bytes_read <= 0 || bytes_read != sizeof(client_send_tsc))
-		{
-			perror("read");
-			exit(EXIT_FAILURE);
-		}
+	shm_set_pos(&r->tail, &r->tail_waiters, tail + n);
+	return n;
+}
 
-		DEBUG_PRINT("Server received %lu bytes ('%llu') at iteration %d.\n", bytes_read, client_send_tsc, i);
+int pipe_wait(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
 
-		if (write(client_sock_fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) != SERVER_RESPONSE_LENGTH)
-		{
-			perror("write");
-			exit(EXIT_FAILURE);
+	switch (recv_mode) {
+	case RECV_EPOLL:
+		return socket_wait(fd);
+	case RECV_BUSY:
+		for (;;) {
+			int ready = poll(&pfd, 1, 0);
+			if (ready > 0 || (ready < 0 && errno != EINTR)) {
+				break;
+			}
+			_mm_pause();
 		}
-
-		ticks[i] = end_rdtsc() - client_send_tsc + client_tsc_offset;
+		break;
+	default:
+		break;
 	}
+	return 0;
 }
 
-int vsock_connect(int server_cid)
+// The read end is O_NONBLOCK unless recv_mode is blocking.
+ssize_t pipe_recv(int fd, void *buf, size_t len)
 {
-	DEBUG_PRINT("Client connecting to cid %d on port %d.\n", server_cid, SERVER_LISTEN_PORT);
+	for (;;) {
+		ssize_t nbytes = read(fd, buf, len);
+		if (nbytes >= 0 || (errno != EAGAIN && errno != EINTR)) {
+			return nbytes;
+		}
+		if (recv_mode == RECV_EPOLL) {
+			if (socket_wait(fd) != 0) {
+				return -1;
+			}
+		} else {
+			_mm_pause();
+		}
+	}
+}
 
-	int fd;
-	struct sockaddr_vm sa = {
-		.svm_family = AF_VSOCK,
-		.svm_port = SERVER_LISTEN_PORT,
-		.svm_cid = server_cid,
-	};
+ssize_t pipe_send(int fd, const void *buf, size_t len)
+{
+	return write(pipe_write_fd, buf, len);
+}
 
-	if (server_cid < 0) {
+// Maps the shm region the server created at path.
+int shm_map(const char *path, int flags)
+{
+	int fd = open(path, flags, 0600);
+	if (fd < 0) {
+		perror("open");
 		return -1;
 	}
-
-	fd = socket(AF_VSOCK, SOCK_STREAM, 0);
-	if (fd < 0) {
-		perror("socket");
+	if ((flags & O_CREAT) && ftruncate(fd, sizeof(struct shm_region)) != 0) {
+		perror("ftruncate");
+		close(fd);
 		return -1;
 	}
 
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-		perror("connect");
+	shm_region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm_region == MAP_FAILED) {
+		perror("mmap");
 		close(fd);
 		return -1;
 	}
-
 	return fd;
 }
 
-int unix_connect(const char *server_unix_path)
+// The server sets up the region under a temporary name and renames it into
+// place, so a client never maps a half initialized (or stale) one.  The
+// "connection" is then just the first run header arriving.
+int shm_listen_and_accept_single_client_connection(struct peer_id *peer)
 {
-	DEBUG_PRINT("Client connecting to unix path '%s'.\n", server_unix_path);
-
-	int fd;
-	struct sockaddr_un sa = {
-		.sun_family = AF_UNIX,
-	};
-	strncpy(sa.sun_path, server_unix_path, sizeof(sa.sun_path)-1);
+	const char *tmp_path = SERVER_SHM_PATH ".tmp";
+	unlink(tmp_path);
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int fd = shm_map(tmp_path, O_RDWR | O_CREAT | O_EXCL);
 	if (fd < 0) {
-		perror("socket");
 		return -1;
 	}
+	memcpy(shm_region->magic, SHM_MAGIC, sizeof(shm_region->magic));
+	shm_rx = &shm_region->to_server;
+	shm_tx = &shm_region->to_client;
 
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-		perror("connect");
+	if (rename(tmp_path, SERVER_SHM_PATH) != 0) {
+		perror("rename");
+		unlink(tmp_path);
 		close(fd);
 		return -1;
 	}
 
+	DEBUG_PRINT("Listening at '%s' ...", SERVER_SHM_PATH);
+
+	snprintf(peer->name, sizeof(peer->name), "shm");
 	return fd;
 }
 
-int inet_connect(const char *server_ip)
+int shm_connect(const char *server_shm_path)
 {
-	DEBUG_PRINT("Client connecting to server ip '%s' on port %u.\n", server_ip, SERVER_LISTEN_PORT);
+	DEBUG_PRINT("Client mapping shm path '%s'.\n", server_shm_path);
 
-	int fd;
-	struct sockaddr_in sa = {
-		.sin_family = AF_INET,
-		.sin_port = htons(SERVER_LISTEN_PORT),
-	};
-	if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1)
-	{
-		perror("inet_pton");
+	int fd = shm_map(server_shm_path, O_RDWR);
+	if (fd < 0) {
+		return -1;
+	}
+	if (memcmp(shm_region->magic, SHM_MAGIC, sizeof(shm_region->magic)) != 0) {
+		fprintf(stderr, "%s isn't a benchmark shm region.\n", server_shm_path);
+		close(fd);
 		return -1;
 	}
+	shm_rx = &shm_region->to_client;
+	shm_tx = &shm_region->to_server;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		perror("socket");
+	return fd;
+}
+
+// Opens our ends of the FIFO pair at path.to-server and path.to-client, in
+// the same order on both sides so the blocking opens pair up.
+int pipe_open(const char *path, bool is_server)
+{
+	char to_server[PATH_MAX], to_client[PATH_MAX];
+	snprintf(to_server, sizeof(to_server), "%s.to-server", path);
+	snprintf(to_client, sizeof(to_client), "%s.to-client", path);
+
+	int read_fd = -1;
+	if (is_server) {
+		read_fd = open(to_server, O_RDONLY);
+		pipe_write_fd = read_fd < 0 ? -1 : open(to_client, O_WRONLY);
+	} else {
+		pipe_write_fd = open(to_server, O_WRONLY);
+		read_fd = pipe_write_fd < 0 ? -1 : open(to_client, O_RDONLY);
+	}
+	if (read_fd < 0 || pipe_write_fd < 0) {
+		perror("open");
 		return -1;
 	}
 
-	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
-		perror("connect");
-		close(fd);
+	if (recv_mode != RECV_BLOCKING && fcntl(read_fd, F_SETFL, O_NONBLOCK) != 0) {
+		perror("fcntl");
 		return -1;
 	}
 
-	return fd;
+	return read_fd;
 }
 
-void run_client(int server_sock_fd)
+int pipe_listen_and_accept_single_client_connection(struct peer_id *peer)
 {
-	for (int i=0; i<ITERATIONS; i++)
-	{
-		tsc_t begin_ts = begin_rdtsc();
-		if (write(server_sock_fd, &begin_ts, sizeof(begin_ts)) != sizeof(begin_ts))
-		{
-			perror("write");
-			exit(EXIT_FAILURE);
+	const char *suffixes[] = { ".to-server", ".to-client" };
+	for (int i=0; i<2; i++) {
+		char fifo_path[PATH_MAX];
+		snprintf(fifo_path, sizeof(fifo_path), "%s%s", SERVER_PIPE_PATH, suffixes[i]);
+		unlink(fifo_path);
+		if (mkfifo(fifo_path, 0600) != 0) {
+			perror("mkfifo");
+			return -1;
 		}
+	}
 
-		char buf[SERVER_RESPONSE_LENGTH+1];
-		memset(buf, '\0', SERVER_RESPONSE_LENGTH + 1);
-		size_t bytes_read = read(server_sock_fd, buf, SERVER_RESPONSE_LENGTH);
-		if (bytes_read <= 0)
-		{
-			perror("read");
-			exit(EXIT_FAILURE);
-		}
+	DEBUG_PRINT("Listening at '%s' ...", SERVER_PIPE_PATH);
 
-		DEBUG_PRINT("Client received %lu bytes ('%s') at iteration %d.\n", bytes_read, buf, i);
+	snprintf(peer->name, sizeof(peer->name), "pipe");
+	return pipe_open(SERVER_PIPE_PATH, true);
+}
 
-		ticks[i] = end_rdtsc() - begin_ts;
-	}
+int pipe_connect(const char *path)
+{
+	return pipe_open(path, false);
 }
 
-int cmp_tsc_t(const void *a, const void *b)
+const struct transport_ops shm_transport = {
+	.name = "shm",
+	.connect = shm_connect,
+	.listen_and_accept = shm_listen_and_accept_single_client_connection,
+	.wait = shm_wait,
+	.recv = shm_recv,
+	.send = shm_send,
+};
+
+const struct transport_ops pipe_transport = {
+	.name = "pipe",
+	.connect = pipe_connect,
+	.listen_and_accept = pipe_listen_and_accept_single_client_connection,
+	.wait = pipe_wait,
+	.recv = pipe_recv,
+	.send = pipe_send,
+};
+
+void pipe_unlink()
 {
-	return (*(tsc_t*)a - *(tsc_t*)b);
+	unlink(SERVER_PIPE_PATH ".to-server");
+	unlink(SERVER_PIPE_PATH ".to-client");
 }
 
-void print_results()
+// Sends n iovecs, one message each, with as few syscalls as it takes:
+// writev() for streams, sendmmsg() for seqpacket so they stay separate.
+int send_batch(int fd, struct iovec *iov, unsigned int n)
 {
-	// exclude the first timing result from the rest of the stats
+	if (!transport->is_socket) {
+		for (unsigned int j=0; j<n; j++) {
+			if (write_full(fd, iov[j].iov_base, iov[j].iov_len) != 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
 
-	tsc_t min = ULONG_MAX;
-	tsc_t max = 0;
-	tsc_t sum = 0;
-	for (int i=1; i<ITERATIONS; i++)
-	{
-		fprintf(stdout, "%4d: %llu\n", i, ticks[i]);
+	if (sock_type == SOCK_SEQPACKET) {
+		struct mmsghdr msgs[MAX_BATCH_SIZE];
+		memset(msgs, 0, n * sizeof(msgs[0]));
+		for (unsigned int j=0; j<n; j++) {
+			msgs[j].msg_hdr.msg_iov = &iov[j];
+			msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+		for (unsigned int sent=0; sent<n; ) {
+			int nmsgs = sendmmsg(fd, msgs + sent, n - sent, 0);
+			if (nmsgs < 0 && errno == EINTR) {
+				continue;
+			} else if (nmsgs <= 0) {
+				return -1;
+			}
+			sent += nmsgs;
+		}
+		return 0;
+	}
 
-		min = (ticks[i] < min) ? ticks[i] : min;
-		max = (ticks[i] > max) ? ticks[i] : max;
-		sum += ticks[i];
+	while (n > 0) {
+		ssize_t nbytes = writev(fd, iov, n);
+		if (nbytes < 0 && errno == EINTR) {
+			continue;
+		} else if (nbytes <= 0) {
+			return -1;
+		}
+		// Skip past whatever went out, resuming mid-iovec if need be.
+		while (n > 0 && (size_t)nbytes >= iov->iov_len) {
+			nbytes -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + nbytes;
+			iov->iov_len -= nbytes;
+		}
 	}
+	return 0;
+}
 
-	long double avg = sum / (long double) ITERATIONS;
-	long double stddev = 0;
-	for (int i=1; i<ITERATIONS; i++)
-	{
-		stddev += pow(ticks[i] - avg, 2);
+// Reads n messages of len bytes each into buf, from as few reads as it
+// takes: one read_full() for streams, recvmmsg() for seqpacket.
+int recv_batch(int fd, char *buf, size_t len, unsigned int n)
+{
+	if (sock_type != SOCK_SEQPACKET) {
+		return read_full(fd, buf, len * n);
 	}
-	stddev = sqrt(stddev / ITERATIONS);
 
-	// sort them to get the median
-	qsort(ticks+1, ITERATIONS-1, sizeof(tsc_t), cmp_tsc_t);
+	struct mmsghdr msgs[MAX_BATCH_SIZE];
+	struct iovec iov[MAX_BATCH_SIZE];
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (unsigned int j=0; j<n; j++) {
+		iov[j].iov_base = buf + j * len;
+		iov[j].iov_len = len;
+		msgs[j].msg_hdr.msg_iov = &iov[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
 
-	fprintf(stdout, "Initial connection/send: %llu\n", ticks[0]);
-	fprintf(stdout, "min: %llu\n", min);
-	fprintf(stdout, "max: %llu\n", max);
-	fprintf(stdout, "median: %llu\n", ticks[ITERATIONS/2]);
-	fprintf(stdout, "avg: %Lf\n", avg);
-	fprintf(stdout, "stddev: %Lf\n", stddev);
+	int flags = recv_mode == RECV_BLOCKING ? 0 : MSG_DONTWAIT;
+	for (unsigned int received=0; received<n; ) {
+		n_read_calls++;
+		int nmsgs = recvmmsg(fd, msgs + received, n - received, flags, NULL);
+		if (nmsgs < 0 && (errno == EAGAIN || errno == EINTR)) {
+			if (recv_wait(fd) != 0) {
+				return -1;
+			}
+			continue;
+		} else if (nmsgs <= 0) {
+			return -1;
+		}
+		for (int j=0; j<nmsgs; j++) {
+			if (msgs[received + j].msg_len != len) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+		}
+		received += nmsgs;
+	}
+	return 0;
 }
 
-void print_usage(const char * msg)
-{
-	fprintf(stderr, "%s\n%s\n", msg, "usage: vsock-latency-benchmark -m <vsock|unix|inet> <-s client-tsc-offset|-c <server-cid|unix-sock-path|ipaddr>>");
-}
+/*
+ * Output files.  --raw-file keeps every sample (like -r, but without the
+ * formatting) in a binary file that's mmap'd and written in place as the
+ * samples come in.  It's a sequence of runs, each a raw_file_header followed
+ * by n_samples tsc_t latencies in ticks, the first of which is the initial
+ * connection/send.  --csv and --json get a summary per run (and per peer
+ * with -N).
+ */
+#define RAW_FILE_MAGIC "VSOCKLAT"
+#define RAW_FILE_VERSION 1
 
-int main(int argc, char** argv)
+struct raw_file_header
 {
-	enum MODE
-	{
-		VSOCK,
-		UNIX,
-		INET,
-	} mode;
-
-	if (argc >= 3 && strcmp(argv[1], "-m") == 0)
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;	// sizeof(struct raw_file_header)
+	uint32_t mode;		// 0 vsock, 1 unix, 2 inet, 3 shm, 4 pipe
+	uint32_t is_server;
+	uint32_t msg_size;
+	uint32_t cid;		// the peer's, with vsock
+	uint64_t n_samples;
+	double tsc_hz;
+	int64_t tsc_offset;	// already applied to the server's samples
+};
+
+// Filled in by main() and copied into each run's header.
+struct raw_file_header raw_file_info;
+const char *raw_file_path = NULL;
+int raw_fd = -1;
+off_t raw_file_size = 0;
+void *raw_map = NULL;
+size_t raw_map_len = 0;
+
+FILE *csv_file = NULL;
+FILE *json_file = NULL;
+int n_json_rows = 0;
+
+// Points ticks at room for a run's n samples, in the raw file if there is
+// one.
+void begin_raw_samples(uint32_t msg_size, unsigned int n)
+{
+	if (!raw_file_path)
 	{
-		if (strcmp(argv[2], "vsock") == 0)
-		{
-			mode = VSOCK;
-		}
-		else if (strcmp(argv[2], "unix") == 0)
+		ticks = realloc(ticks, n * sizeof(tsc_t));
+		if (!ticks)
 		{
-			mode = UNIX;
-		}
-		else if (strcmp(argv[2], "inet") == 0)
-		{
-			mode = INET;
+			perror("realloc");
+			exit(EXIT_FAILURE);
 		}
-		else
+		prefault(ticks, n * sizeof(tsc_t));
+		return;
+	}
+
+	if (raw_fd < 0)
+	{
+		raw_fd = open(raw_file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (raw_fd < 0)
 		{
-			print_usage("Unhandled mode argument.");
-			return EXIT_FAILURE;
+			perror(raw_file_path);
+			exit(EXIT_FAILURE);
 		}
 	}
-	else
+
+	off_t start = raw_file_size;
+	size_t len = sizeof(struct raw_file_header) + (size_t)n * sizeof(tsc_t);
+	if (ftruncate(raw_fd, start + len) != 0)
 	{
-		print_usage("Invalid number/type/order of arguments.");
-		return EXIT_FAILURE;
+		perror("ftruncate");
+		exit(EXIT_FAILURE);
 	}
 
-	if (argc == 5 && strcmp(argv[3], "-s") == 0)
+	// mmap() offsets have to be page aligned, runs needn't be.
+	off_t map_start = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	raw_map_len = start + len - map_start;
+	raw_map = mmap(NULL, raw_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, raw_fd, map_start);
+	if (raw_map == MAP_FAILED)
 	{
-		int client_sock_fd = -1;
-		switch (mode)
-		{
-			case VSOCK:
-				client_sock_fd = vsock_listen_and_accept_single_client_connection();
-				break;
-			case UNIX:
-				client_sock_fd = unix_listen_and_accept_single_client_connection();
-				break;
-			case INET:
-				client_sock_fd = inet_listen_and_accept_single_client_connection();
-				break;
-			default:
-				print_usage("Unhandled mode.");
-				return EXIT_FAILURE;
-		}
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
 
-		long long client_tsc_offset = parse_client_tsc_offset(argv[4]);
-		if (client_tsc_offset == -1)
-		{
-			print_usage("Failed to parse client_tsc_offset argument.");
-			return EXIT_FAILURE;
-		}
+	struct raw_file_header *rh = (void *)((char *)raw_map + (start - map_start));
+	*rh = raw_file_info;
+	memcpy(rh->magic, RAW_FILE_MAGIC, sizeof(rh->magic));
+	rh->version = RAW_FILE_VERSION;
+	rh->header_size = sizeof(*rh);
+	rh->msg_size = msg_size;
+	rh->n_samples = n;
+	rh->tsc_hz = tsc_hz;
+
+	ticks = (tsc_t *)(rh + 1);
+	raw_file_size = start + len;
+	prefault(raw_map, raw_map_len);
+}
 
-		run_server(client_sock_fd, client_tsc_offset);
+void end_raw_samples()
+{
+	if (raw_map)
+	{
+		munmap(raw_map, raw_map_len);
+		raw_map = NULL;
+		ticks = NULL;
+	}
+}
 
-		if (mode == UNIX)
+int open_summary_files(const char *csv_path, const char *json_path)
+{
+	if (csv_path)
+	{
+		csv_file = fopen(csv_path, "w");
+		if (!csv_file)
 		{
-			unlink(SERVER_UNIX_PATH);
+			perror(csv_path);
+			return -1;
 		}
+		fprintf(csv_file, "role,peer,size,count,initial,min,p50,p90,p99,p99.9,p99.99,max,avg,stddev,tsc_hz\n");
 	}
-	else if (argc == 5 && strcmp(argv[3], "-c") == 0)
+	if (json_path)
 	{
-		int server_sock_fd = -1;
-		switch (mode)
+		json_file = fopen(json_path, "w");
+		if (!json_file)
 		{
-			case VSOCK:
-				// arg is expected to typically be 2 for the host cid constant
-				server_sock_fd = vsock_connect(parse_cid(argv[4]));
-				break;
-			case UNIX:
-				// arg is expected to typically be SERVER_UNIX_PATH
-				server_sock_fd = unix_connect(argv[4]);
-				break;
-			case INET:
-				// arg is expected to typically be 127.0.0.1
-				server_sock_fd = inet_connect(argv[4]);
-				break;
-			default:
-				print_usage("Unhandled mode.");
-				return EXIT_FAILURE;
+			perror(json_path);
+			return -1;
 		}
+		fprintf(json_file, "[");
+	}
+	return 0;
+}
 
-		run_client(server_sock_fd);
+void close_output_files()
+{
+	if (csv_file)
+	{
+		fclose(csv_file);
 	}
-	else
+	if (json_file)
 	{
-		print_usage("Invalid number/type/order of arguments.");
-		return EXIT_FAILURE;
+		fprintf(json_file, "\n]\n");
+		fclose(json_file);
+	}
+	if (raw_fd >= 0)
+	{
+		close(raw_fd);
+	}
+}
+
+// Adds a summary of h (in ticks) to the --csv and --json files.
+void write_summary(const char *peer, uint32_t msg_size, tsc_t initial, const struct histogram *h)
+{
+	bool is_server = raw_file_info.is_server;
+	long double avg, stddev;
+	hist_avg_stddev(h, &avg, &stddev);
+	tsc_t min = h->count ? h->min : 0;
+
+	if (csv_file)
+	{
+		fprintf(csv_file, "%s,%s,%u,%lu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3Lf,%.3Lf,%.0f\n",
+			is_server ? "server" : "client", peer, msg_size, h->count, initial, min,
+			hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99),
+			hist_percentile(h, 99.9), hist_percentile(h, 99.99), h->max, avg, stddev, tsc_hz);
+	}
+	if (json_file)
+	{
+		fprintf(json_file, "%s\n  {\"role\": \"%s\", \"peer\": \"%s\", \"size\": %u, \"count\": %lu, "
+			"\"initial\": %llu, \"min\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+			"\"p99.9\": %llu, \"p99.99\": %llu, \"max\": %llu, \"avg\": %.3Lf, \"stddev\": %.3Lf, "
+			"\"tsc_hz\": %.0f}",
+			n_json_rows++ ? "," : "", is_server ? "server" : "client", peer, msg_size, h->count,
+			initial, min, hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99),
+			hist_percentile(h, 99.9), hist_percentile(h, 99.99), h->max, avg, stddev, tsc_hz);
+	}
+}
+
+void print_results(uint32_t msg_size, unsigned int n);
+
+static inline void record_sample(unsigned int i, tsc_t latency)
+{
+	if (warming_up)
+	{
+		return;
+	}
+
+	if (i == 0)
+	{
+		initial = latency;
+	}
+	else
+	{
+		hist_record(&hist, latency);
+		timeline_record(latency);
+	}
+
+	if (raw)
+	{
+		ticks[i] = latency;
+	}
+}
+
+// The current message size's --trials, with the batch syscall stats merged
+// alongside.
+struct trial_series series;
+struct histogram series_syscall_hist;
+unsigned long series_read_calls;
+
+void reset_series()
+{
+	trials_reset(&series);
+	hist_reset(&series_syscall_hist);
+	series_read_calls = 0;
+}
+
+// Adds the run just done to the series.
+void add_trial(uint32_t msg_size, unsigned int n)
+{
+	trials_add(&series, initial, &hist, n);
+	hist_merge(&series_syscall_hist, &syscall_hist);
+	series_read_calls += n_read_calls;
+	fprintf(stderr, "trial %u size %u: p50 %llu p99 %llu ticks\n",
+		series.n, msg_size, series.p50[series.n - 1], series.p99[series.n - 1]);
+}
+
+void print_series_results(uint32_t msg_size)
+{
+	memcpy(&hist, &series.hist, sizeof(hist));
+	memcpy(&syscall_hist, &series_syscall_hist, sizeof(syscall_hist));
+	initial = series.initial;
+	n_read_calls = series_read_calls;
+	print_results(msg_size, series.iterations);
+	print_trials(msg_size, &series);
+	reset_series();
+}
+
+// recv_wait() for trace runs, which also waits in blocking mode so that the
+// server's wakeup stamp is taken once the message is there rather than
+// before the read goes to sleep.  shm_wait() always does.
+int trace_wait(int fd)
+{
+	if (recv_mode == RECV_BLOCKING && transport != &shm_transport)
+	{
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN,
+		};
+		while (poll(&pfd, 1, -1) < 0)
+		{
+			if (errno != EINTR)
+			{
+				return -1;
+			}
+		}
+	}
+	return recv_wait(fd);
+}
+
+void run_server(int client_sock_fd, long long client_tsc_offset)
+{
+	DEBUG_PRINT("Server using tsc-offset of %lld.\n", client_tsc_offset);
+
+	char *buf = NULL;
+	reset_series();
+
+	for (;;)
+	{
+		struct run_header hdr;
+		if (read_full(client_sock_fd, &hdr, sizeof(hdr)) != 0)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		if (hdr.marker != RUN_HEADER_MARKER)
+		{
+			fprintf(stderr, "%s\n", "Unexpected run header from client (mismatched versions?).");
+			exit(EXIT_FAILURE);
+		}
+		if (hdr.msg_size == 0)
+		{
+			break;
+		}
+		if (hdr.msg_size < sizeof(tsc_t) || hdr.msg_size > MAX_MESSAGE_LENGTH || hdr.iterations == 0)
+		{
+			fprintf(stderr, "Invalid run header (msg_size: %u, iterations: %u).\n", hdr.msg_size, hdr.iterations);
+			exit(EXIT_FAILURE);
+		}
+
+		DEBUG_PRINT("Server expecting %u messages of %u bytes.\n", hdr.iterations, hdr.msg_size);
+		sweep = hdr.flags & RUN_FLAG_SWEEP;
+		if (hdr.flags & RUN_FLAG_TRIALS_DONE)
+		{
+			if (series.n != hdr.iterations)
+			{
+				fprintf(stderr, "Client ran %u trials, we saw %u.\n", hdr.iterations, series.n);
+				exit(EXIT_FAILURE);
+			}
+			print_series_results(hdr.msg_size);
+			continue;
+		}
+		warming_up = hdr.flags & RUN_FLAG_WARMUP;
+		bool trial = hdr.flags & RUN_FLAG_TRIAL;
+
+		// Ack the header so the first timed message isn't held back
+		// behind it (eg: by Nagle for inet).  Syncing acks it once done,
+		// though warmup runs make do with the last estimate.
+		if (sync_tsc_offset && (!warming_up || clock_sync.n == 0))
+		{
+			if (sync_clock(client_sock_fd) != 0)
+			{
+				perror("sync");
+				exit(EXIT_FAILURE);
+			}
+			raw_file_info.tsc_offset = clock_sync.offset;
+		}
+		else if (write_full(client_sock_fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+
+		batch_size = hdr.batch ? hdr.batch : 1;
+		bool trace_run = hdr.flags & RUN_FLAG_TRACE;
+		if (batch_size > MAX_BATCH_SIZE || (trace_run && batch_size > 1))
+		{
+			fprintf(stderr, "Invalid run header (batch: %u, flags: %#x).\n", hdr.batch, hdr.flags);
+			exit(EXIT_FAILURE);
+		}
+
+		buf = realloc(buf, (size_t)hdr.msg_size * batch_size);
+		if (!buf)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		if (raw && !warming_up)
+		{
+			begin_raw_samples(hdr.msg_size, hdr.iterations);
+		}
+		hist_reset(&hist);
+		hist_reset(&syscall_hist);
+		n_read_calls = 0;
+		// The counters cover all of a size's trials together.
+		if (!trial || series.n == 0)
+		{
+			perf_begin_run();
+			timeline_begin_run();
+		}
+
+		// The client sends batch_size messages at a time (fewer at the
+		// end) and expects one ack for each batch.
+		for (unsigned int i=0; i<hdr.iterations; i+=batch_size)
+		{
+			unsigned int n = hdr.iterations - i < batch_size ? hdr.iterations - i : batch_size;
+			perf_sample_begin();
+
+			// With epoll or busy reads (or --trace) this times just the
+			// read(s).
+			if ((trace_run ? trace_wait(client_sock_fd) : recv_wait(client_sock_fd)) != 0)
+			{
+				perror("recv_wait");
+				exit(EXIT_FAILURE);
+			}
+			tsc_t read_begin = begin_rdtsc();
+			if (recv_batch(client_sock_fd, buf, hdr.msg_size, n) != 0)
+			{
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+			tsc_t read_end = end_rdtsc();
+			hist_record(&syscall_hist, read_end - read_begin);
+			long long offset = sync_tsc_offset ? synced_offset(read_end) : client_tsc_offset;
+
+			DEBUG_PRINT("Server received %u messages of %u bytes at iteration %u.\n", n, hdr.msg_size, i);
+
+			int ret;
+			if (trace_run)
+			{
+				struct trace_reply reply = {
+					.wakeup = read_begin + offset,
+					.read_end = read_end + offset,
+				};
+				reply.ack_begin = begin_rdtsc() + offset;
+				ret = write_full(client_sock_fd, &reply, sizeof(reply));
+			}
+			else
+			{
+				ret = write_full(client_sock_fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH);
+			}
+			if (ret != 0)
+			{
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+
+			tsc_t now = end_rdtsc();
+			for (unsigned int j=0; j<n; j++)
+			{
+				tsc_t client_send_tsc;
+				memcpy(&client_send_tsc, buf + (size_t)j * hdr.msg_size, sizeof(client_send_tsc));
+				tsc_t latency = now - client_send_tsc + offset;
+				record_sample(i + j, latency);
+				// A batch goes by its oldest message.
+				if (j == 0)
+				{
+					perf_sample_end(latency);
+				}
+			}
+		}
+		perf_end_run();
+
+		if (trial)
+		{
+			add_trial(hdr.msg_size, hdr.iterations);
+		}
+		else if (!warming_up)
+		{
+			print_results(hdr.msg_size, hdr.iterations);
+		}
+		end_raw_samples();
+	}
+
+	free(buf);
+}
+
+/*
+ * Multi-client server (-N): accepts that many clients (eg: one per VM) and
+ * multiplexes them with epoll over -W worker threads, like a host
+ * arbitrator serving many guests at once.  Each client speaks the same
+ * protocol as with the single-client server, and keeps a histogram per run
+ * that only its worker touches; they're merged per peer and overall once
+ * every client has finished.
+ */
+struct client_run
+{
+	uint32_t msg_size;
+	tsc_t initial;
+	struct histogram hist;
+};
+
+struct client
+{
+	int fd;
+	struct peer_id peer;
+	long long tsc_offset;
+
+	struct run_header hdr;
+	bool in_run;		// reading messages (or else the next header)
+	unsigned int received;	// messages so far in this run
+	char *buf;
+	size_t fill;		// bytes read of the current header/message
+
+	struct client_run *runs;
+	int n_runs;
+	bool done;
+};
+
+struct server_worker
+{
+	pthread_t thread;
+	int epfd;
+	struct client **clients;
+	int n_clients;
+};
+
+int n_server_clients = 0;
+int n_server_workers = 1;
+
+// Handles a complete header, returning -1 if the client should be dropped.
+int client_start_run(struct client *c)
+{
+	struct run_header *hdr = &c->hdr;
+
+	if (hdr->marker != RUN_HEADER_MARKER)
+	{
+		fprintf(stderr, "%s: unexpected run header (mismatched versions?).\n", c->peer.name);
+		return -1;
+	}
+	if (hdr->msg_size == 0)
+	{
+		c->done = true;
+		return 0;
+	}
+	if (hdr->msg_size < sizeof(tsc_t) || hdr->msg_size > MAX_MESSAGE_LENGTH || hdr->iterations == 0)
+	{
+		fprintf(stderr, "%s: invalid run header (msg_size: %u, iterations: %u).\n", c->peer.name, hdr->msg_size, hdr->iterations);
+		return -1;
+	}
+	if (hdr->flags & (RUN_FLAG_TRACE | RUN_FLAG_WARMUP | RUN_FLAG_TRIAL | RUN_FLAG_TRIALS_DONE))
+	{
+		fprintf(stderr, "%s: --trace, --warmup and --trials need a single client server (no -N).\n", c->peer.name);
+		return -1;
+	}
+
+	struct client_run *runs = realloc(c->runs, (c->n_runs + 1) * sizeof(*runs));
+	char *buf = realloc(c->buf, hdr->msg_size);
+	if (runs)
+	{
+		c->runs = runs;
+	}
+	if (buf)
+	{
+		c->buf = buf;
+	}
+	if (!runs || !buf)
+	{
+		perror("realloc");
+		return -1;
+	}
+
+	struct client_run *run = &c->runs[c->n_runs++];
+	run->msg_size = hdr->msg_size;
+	run->initial = 0;
+	hist_reset(&run->hist);
+	c->in_run = true;
+	c->received = 0;
+
+	DEBUG_PRINT("%s: expecting %u messages of %u bytes.\n", c->peer.name, hdr->iterations, hdr->msg_size);
+
+	if (write(c->fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) != SERVER_RESPONSE_LENGTH)
+	{
+		perror("write");
+		return -1;
+	}
+	return 0;
+}
+
+// Handles a complete message, returning -1 if the client should be dropped.
+int client_handle_message(struct client *c)
+{
+	struct client_run *run = &c->runs[c->n_runs - 1];
+	tsc_t client_send_tsc;
+	memcpy(&client_send_tsc, c->buf, sizeof(client_send_tsc));
+
+	// Batched clients (-b) want one ack per batch, after its last message.
+	uint32_t batch = c->hdr.batch ? c->hdr.batch : 1;
+	if ((c->received + 1) % batch == 0 || c->received + 1 == c->hdr.iterations)
+	{
+		if (write(c->fd, SERVER_RESPONSE_MESSAGE, SERVER_RESPONSE_LENGTH) != SERVER_RESPONSE_LENGTH)
+		{
+			perror("write");
+			return -1;
+		}
+	}
+
+	tsc_t latency = end_rdtsc() - client_send_tsc + c->tsc_offset;
+	if (c->received == 0)
+	{
+		run->initial = latency;
+	}
+	else
+	{
+		hist_record(&run->hist, latency);
+	}
+
+	if (++c->received == c->hdr.iterations)
+	{
+		c->in_run = false;
+	}
+	return 0;
+}
+
+// Reads whatever the client has sent so far, returning -1 if the client
+// should be dropped.
+int client_service(struct client *c)
+{
+	while (!c->done)
+	{
+		char *target = c->in_run ? c->buf : (char *)&c->hdr;
+		size_t want = c->in_run ? c->hdr.msg_size : sizeof(c->hdr);
+
+		ssize_t nbytes = recv(c->fd, target + c->fill, want - c->fill, MSG_DONTWAIT);
+		if (nbytes < 0 && (errno == EAGAIN || errno == EINTR))
+		{
+			return 0;
+		}
+		if (nbytes <= 0)
+		{
+			fprintf(stderr, "%s: %s\n", c->peer.name, nbytes == 0 ? "unexpected EOF" : strerror(errno));
+			return -1;
+		}
+
+		c->fill += nbytes;
+		if (c->fill < want)
+		{
+			continue;
+		}
+		c->fill = 0;
+
+		if ((c->in_run ? client_handle_message(c) : client_start_run(c)) != 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void *server_worker_main(void *opaque)
+{
+	struct server_worker *w = opaque;
+	struct epoll_event events[64];
+	int remaining = w->n_clients;
+
+	// Busy mode spins on epoll_wait() rather than sleeping in it.
+	int timeout = recv_mode == RECV_BUSY ? 0 : -1;
+
+	while (remaining > 0)
+	{
+		int n = epoll_wait(w->epfd, events, 64, timeout);
+		if (n < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i=0; i<n; i++)
+		{
+			struct client *c = events[i].data.ptr;
+			if (client_service(c) != 0)
+			{
+				c->done = true;
+			}
+			if (c->done)
+			{
+				epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+				remaining--;
+			}
+		}
+	}
+	return NULL;
+}
+
+// The header for print_hist_row(), with what for its first column.
+void print_hist_header(const char *what)
+{
+	fprintf(stdout, "%-20s %10s %7s %10s %5s %12s %12s %12s %12s %12s %12s %12s %14s %14s\n",
+		what, "size", "clients", "count", "unit", "min", "p50", "p90", "p99", "p99.9", "p99.99", "max", "avg", "stddev");
+}
+
+void print_hist_row(const char *who, uint32_t msg_size, int n_clients, struct histogram *h)
+{
+	write_summary(who, msg_size, 0, h);
+
+	long double avg, stddev;
+	hist_avg_stddev(h, &avg, &stddev);
+	tsc_t min = h->count ? h->min : 0;
+	tsc_t p50 = hist_percentile(h, 50);
+	tsc_t p90 = hist_percentile(h, 90);
+	tsc_t p99 = hist_percentile(h, 99);
+	tsc_t p999 = hist_percentile(h, 99.9);
+	tsc_t p9999 = hist_percentile(h, 99.99);
+	fprintf(stdout, "%-20s %10u %7d %10lu %5s %12llu %12llu %12llu %12llu %12llu %12llu %12llu %14.3Lf %14.3Lf\n",
+		who, msg_size, n_clients, h->count, "ticks", min, p50, p90, p99, p999, p9999, h->max, avg, stddev);
+	fprintf(stdout, "%-20s %10u %7d %10lu %5s %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %14.3f %14.3f\n",
+		who, msg_size, n_clients, h->count, "ns", tsc_to_ns(min), tsc_to_ns(p50), tsc_to_ns(p90),
+		tsc_to_ns(p99), tsc_to_ns(p999), tsc_to_ns(p9999), tsc_to_ns(h->max),
+		tsc_to_ns(avg), tsc_to_ns(stddev));
+}
+
+// Prints one row per message size, merging the runs of every client that
+// from_peer (or NULL for all of them) picks out.
+void print_peer_results(const char *who, struct client *clients, const char *from_peer, struct histogram *merged)
+{
+	uint32_t sizes[MAX_SWEEP_SIZES];
+	int n_sizes = 0;
+
+	for (int i=0; i<n_server_clients; i++)
+	{
+		if (from_peer && strcmp(clients[i].peer.name, from_peer) != 0)
+		{
+			continue;
+		}
+		for (int r=0; r<clients[i].n_runs; r++)
+		{
+			int s = 0;
+			while (s < n_sizes && sizes[s] != clients[i].runs[r].msg_size)
+			{
+				s++;
+			}
+			if (s == n_sizes && n_sizes < MAX_SWEEP_SIZES)
+			{
+				sizes[n_sizes++] = clients[i].runs[r].msg_size;
+			}
+		}
+	}
+
+	for (int s=0; s<n_sizes; s++)
+	{
+		int n_clients = 0;
+		hist_reset(merged);
+		for (int i=0; i<n_server_clients; i++)
+		{
+			if (from_peer && strcmp(clients[i].peer.name, from_peer) != 0)
+			{
+				continue;
+			}
+			bool counted = false;
+			for (int r=0; r<clients[i].n_runs; r++)
+			{
+				if (clients[i].runs[r].msg_size == sizes[s])
+				{
+					hist_merge(merged, &clients[i].runs[r].hist);
+					counted = true;
+				}
+			}
+			n_clients += counted;
+		}
+		print_hist_row(who, sizes[s], n_clients, merged);
+	}
+}
+
+void run_multi_server(int listen_fd, int (*accept_client)(int, struct peer_id *), long long client_tsc_offset)
+{
+	struct client *clients = calloc(n_server_clients, sizeof(*clients));
+	struct server_worker *workers = calloc(n_server_workers, sizeof(*workers));
+	struct histogram *merged = malloc(sizeof(*merged));
+	if (!clients || !workers || !merged)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int w=0; w<n_server_workers; w++)
+	{
+		workers[w].epfd = epoll_create1(0);
+		workers[w].clients = calloc(n_server_clients, sizeof(struct client *));
+		if (workers[w].epfd < 0 || !workers[w].clients)
+		{
+			perror("epoll_create1");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Accept everyone before starting so the runs overlap as much as
+	// possible (clients just wait for their header ack meanwhile).
+	for (int i=0; i<n_server_clients; i++)
+	{
+		struct client *c = &clients[i];
+		c->fd = accept_client(listen_fd, &c->peer);
+		if (c->fd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		c->tsc_offset = client_tsc_offset;
+		if (auto_tsc_offset && resolve_tsc_offset(&c->peer, &c->tsc_offset) != 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+
+		struct server_worker *w = &workers[i % n_server_workers];
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = c,
+		};
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+		{
+			perror("epoll_ctl");
+			exit(EXIT_FAILURE);
+		}
+		w->clients[w->n_clients++] = c;
+	}
+	close(listen_fd);
+
+	DEBUG_PRINT("Server serving %d clients over %d workers.\n", n_server_clients, n_server_workers);
+
+	for (int w=0; w<n_server_workers; w++)
+	{
+		pthread_create(&workers[w].thread, NULL, server_worker_main, &workers[w]);
+	}
+	for (int w=0; w<n_server_workers; w++)
+	{
+		pthread_join(workers[w].thread, NULL);
+		close(workers[w].epfd);
+		free(workers[w].clients);
+	}
+
+	print_hist_header("peer");
+	for (int i=0; i<n_server_clients; i++)
+	{
+		// Once per peer, at its first client.
+		int first = 0;
+		while (strcmp(clients[first].peer.name, clients[i].peer.name) != 0)
+		{
+			first++;
+		}
+		if (first == i)
+		{
+			print_peer_results(clients[i].peer.name, clients, clients[i].peer.name, merged);
+		}
+	}
+	print_peer_results("all", clients, NULL, merged);
+
+	for (int i=0; i<n_server_clients; i++)
+	{
+		close(clients[i].fd);
+		free(clients[i].buf);
+		free(clients[i].runs);
+	}
+	free(clients);
+	free(workers);
+	free(merged);
+}
+
+static inline void record_stage(enum trace_stage stage, tsc_t from, tsc_t to)
+{
+	if (to < from)
+	{
+		n_trace_clamped++;
+		to = from;
+	}
+	hist_record(&trace_hists[stage], to - from);
+}
+
+void record_trace(tsc_t write_begin, tsc_t write_end, const struct trace_reply *reply, tsc_t ack_end)
+{
+	record_stage(TRACE_CLIENT_WRITE, write_begin, write_end);
+	record_stage(TRACE_TO_WAKEUP, write_end, reply->wakeup);
+	record_stage(TRACE_SERVER_READ, reply->wakeup, reply->read_end);
+	record_stage(TRACE_SERVER_TO_ACK, reply->read_end, reply->ack_begin);
+	record_stage(TRACE_ACK_RETURN, reply->ack_begin, ack_end);
+}
+
+void run_closed_loop(int server_sock_fd, char *msg, uint32_t msg_size, unsigned int count)
+{
+	struct iovec iov[MAX_BATCH_SIZE];
+	tsc_t begin_ts[MAX_BATCH_SIZE];
+
+	hist_reset(&syscall_hist);
+
+	// batch_size messages at a time (fewer at the end), each with its own
+	// timestamp, in one send and acked once.
+	for (unsigned int i=0; i<count; i+=batch_size)
+	{
+		unsigned int n = count - i < batch_size ? count - i : batch_size;
+		perf_sample_begin();
+		for (unsigned int j=0; j<n; j++)
+		{
+			char *m = msg + (size_t)j * msg_size;
+			begin_ts[j] = begin_rdtsc();
+			memcpy(m, &begin_ts[j], sizeof(begin_ts[j]));
+			iov[j].iov_base = m;
+			iov[j].iov_len = msg_size;
+		}
+
+		tsc_t send_begin = begin_rdtsc();
+		if (send_batch(server_sock_fd, iov, n) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		tsc_t send_end = end_rdtsc();
+		hist_record(&syscall_hist, send_end - send_begin);
+
+		tsc_t now;
+		if (trace)
+		{
+			struct trace_reply reply;
+			if (read_full(server_sock_fd, &reply, sizeof(reply)) != 0)
+			{
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+			now = end_rdtsc();
+			// Like the histogram, leaving out the initial send.
+			if (i > 0 && !warming_up)
+			{
+				record_trace(begin_ts[0], send_end, &reply, now);
+			}
+		}
+		else
+		{
+			char buf[SERVER_RESPONSE_LENGTH+1];
+			memset(buf, '\0', SERVER_RESPONSE_LENGTH + 1);
+			ssize_t bytes_read = recv_some(server_sock_fd, buf, SERVER_RESPONSE_LENGTH);
+			if (bytes_read <= 0)
+			{
+				perror("read");
+				exit(EXIT_FAILURE);
+			}
+
+			DEBUG_PRINT("Client received %lu bytes ('%s') at iteration %u.\n", bytes_read, buf, i);
+
+			now = end_rdtsc();
+		}
+		for (unsigned int j=0; j<n; j++)
+		{
+			record_sample(i + j, now - begin_ts[j]);
+		}
+		perf_sample_end(now - begin_ts[0]);
+	}
+}
+
+/*
+ * Open-loop mode: messages go out on a fixed schedule whether or not earlier
+ * ones have been acked, and each latency is measured from the time the
+ * message was *supposed* to be sent.  When the server stalls, the messages
+ * that should have gone out meanwhile are charged for the wait instead of
+ * silently not being sent (coordinated omission).  The intended send time
+ * is also what goes in the message, so the server's one-way numbers get the
+ * same correction.
+ */
+struct open_loop
+{
+	int fd;
+	int epfd;		// the sender's recv_epfd
+	struct histogram *hist;	// the sender's hist, and initial
+	tsc_t *initial;
+	tsc_t *intended;	// ring of max_inflight intended send times
+	unsigned int acked;	// accessed atomically
+};
+
+void *open_loop_receiver(void *opaque)
+{
+	struct open_loop *ol = opaque;
+	char buf[4096];
+
+	// Record into our own hist (and reads use our recv_epfd), then hand
+	// the results back to the sender once done.
+	recv_epfd = ol->epfd;
+	hist_reset(&hist);
+
+	while (ol->acked < iterations)
+	{
+		ssize_t bytes_read = recv_some(ol->fd, buf, sizeof(buf));
+		if (bytes_read <= 0)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		tsc_t now = end_rdtsc();
+
+		// Acks are one byte each and come back in order.
+		for (ssize_t j=0; j<bytes_read / SERVER_RESPONSE_LENGTH; j++)
+		{
+			unsigned int i = ol->acked;
+			record_sample(i, now - ol->intended[i % max_inflight]);
+			__atomic_store_n(&ol->acked, i + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	memcpy(ol->hist, &hist, sizeof(hist));
+	*ol->initial = initial;
+	return NULL;
+}
+
+void run_open_loop(int server_sock_fd, char *msg, uint32_t msg_size)
+{
+	struct open_loop ol = {
+		.fd = server_sock_fd,
+		.epfd = recv_epfd,
+		.hist = &hist,
+		.initial = &initial,
+		.intended = calloc(max_inflight, sizeof(tsc_t)),
+	};
+	pthread_t receiver;
+	tsc_t period = tsc_hz / target_rate;
+	uint64_t late = 0;
+	uint64_t throttled = 0;
+
+	if (!ol.intended)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	pthread_create(&receiver, NULL, open_loop_receiver, &ol);
+
+	tsc_t start = begin_rdtsc();
+	for (unsigned int i=0; i<iterations; i++)
+	{
+		tsc_t intended = start + i * period;
+		tsc_t now;
+		while ((now = begin_rdtsc()) < intended)
+		{
+			_mm_pause();
+		}
+		if (now - intended > period)
+		{
+			late++;
+		}
+
+		if (i - __atomic_load_n(&ol.acked, __ATOMIC_ACQUIRE) >= max_inflight)
+		{
+			throttled++;
+			while (i - __atomic_load_n(&ol.acked, __ATOMIC_ACQUIRE) >= max_inflight)
+			{
+				_mm_pause();
+			}
+		}
+
+		ol.intended[i % max_inflight] = intended;
+		memcpy(msg, &intended, sizeof(intended));
+		if (write_full(server_sock_fd, msg, msg_size) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+	double send_sec = (begin_rdtsc() - start) / tsc_hz;
+
+	pthread_join(receiver, NULL);
+	free(ol.intended);
+
+	fprintf(stderr, "open-loop: target %.0f msg/s, sent at %.0f msg/s, %lu late sends, %lu throttled at %u in flight\n",
+		target_rate, iterations / send_sec, late, throttled, max_inflight);
+}
+
+// One row per --trace stage and message size, from n_msg_sizes sets of
+// N_TRACE_STAGES histograms.
+void print_trace_results(struct histogram *hists)
+{
+	print_hist_header("stage");
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		for (int stage=0; stage<N_TRACE_STAGES; stage++)
+		{
+			print_hist_row(trace_stage_names[stage], msg_sizes[j], 1, &hists[j * N_TRACE_STAGES + stage]);
+		}
+	}
+	if (n_trace_clamped > 0)
+	{
+		fprintf(stderr, "warning: %lu stages came out negative and were counted as 0 (the server woke before the client's write returned, or the tsc-offset is off)\n",
+			n_trace_clamped);
+	}
+}
+
+// Starts a run of n messages of msg_size (waiting for the server's ack,
+// except for the end of a series of trials, which it doesn't ack).
+void start_run(int server_sock_fd, uint32_t msg_size, unsigned int n, uint32_t flags)
+{
+	struct run_header hdr = {
+		.marker = RUN_HEADER_MARKER,
+		.msg_size = msg_size,
+		.iterations = n,
+		.flags = flags | (sweep ? RUN_FLAG_SWEEP : 0) | (trace ? RUN_FLAG_TRACE : 0),
+		.batch = batch_size,
+	};
+	if (write_full(server_sock_fd, &hdr, sizeof(hdr)) != 0)
+	{
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+	if (flags & RUN_FLAG_TRIALS_DONE)
+	{
+		return;
+	}
+	// A server with -s sync probes our clock before the real ack.
+	char ack;
+	do
+	{
+		if (read_full(server_sock_fd, &ack, sizeof(ack)) != 0 ||
+		    (ack == SYNC_REQUEST_MESSAGE[0] && answer_sync(server_sock_fd) != 0))
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+	} while (ack == SYNC_REQUEST_MESSAGE[0]);
+}
+
+// Untimed closed loop runs ahead of a message size's trials, of
+// warmup_iterations messages or as many WARMUP_ROUNDs as fit in warmup_sec.
+void run_warmup(int server_sock_fd, char *msg, uint32_t msg_size)
+{
+	unsigned int n = warmup_iterations ? warmup_iterations : WARMUP_ROUND;
+	tsc_t start = begin_rdtsc();
+
+	warming_up = true;
+	do
+	{
+		start_run(server_sock_fd, msg_size, n, RUN_FLAG_WARMUP);
+		run_closed_loop(server_sock_fd, msg, msg_size, n);
+	} while (warmup_sec > 0 && (begin_rdtsc() - start) / tsc_hz < warmup_sec);
+	warming_up = false;
+}
+
+// One timed run of iterations messages, leaving its results in hist.
+void run_trial(int server_sock_fd, char *msg, uint32_t msg_size, uint32_t flags)
+{
+	start_run(server_sock_fd, msg_size, iterations, flags);
+
+	hist_reset(&hist);
+	if (raw)
+	{
+		begin_raw_samples(msg_size, iterations);
+	}
+
+	if (target_rate > 0)
+	{
+		run_open_loop(server_sock_fd, msg, msg_size);
+	}
+	else
+	{
+		run_closed_loop(server_sock_fd, msg, msg_size, iterations);
+	}
+}
+
+// Runs each message size over server_sock_fd, printing the results of each,
+// or with results (and initials) set, saving them there per message size.
+void run_client_session(int server_sock_fd, struct histogram *results, tsc_t *initials)
+{
+	uint32_t max_size = 0;
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		max_size = msg_sizes[j] > max_size ? msg_sizes[j] : max_size;
+	}
+
+	char *msg = calloc(batch_size, max_size);
+	// Printed once all the sizes are done, so a sweep's table stays whole.
+	struct histogram *all_trace_hists = trace ? calloc(n_msg_sizes * N_TRACE_STAGES, sizeof(struct histogram)) : NULL;
+	if (!msg || (trace && !all_trace_hists))
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		uint32_t msg_size = msg_sizes[j];
+		if (trace)
+		{
+			trace_hists = all_trace_hists + j * N_TRACE_STAGES;
+			for (int stage=0; stage<N_TRACE_STAGES; stage++)
+			{
+				hist_reset(&trace_hists[stage]);
+			}
+		}
+		if (warmup_iterations > 0 || warmup_sec > 0)
+		{
+			run_warmup(server_sock_fd, msg, msg_size);
+		}
+
+		perf_begin_run();
+		timeline_begin_run();
+		if (n_trials > 1)
+		{
+			reset_series();
+			while (series.n < n_trials && !trials_converged(&series))
+			{
+				run_trial(server_sock_fd, msg, msg_size, RUN_FLAG_TRIAL);
+				end_raw_samples();
+				add_trial(msg_size, iterations);
+			}
+			perf_end_run();
+			start_run(server_sock_fd, msg_size, series.n, RUN_FLAG_TRIALS_DONE);
+			print_series_results(msg_size);
+			continue;
+		}
+
+		run_trial(server_sock_fd, msg, msg_size, 0);
+		perf_end_run();
+
+		if (results)
+		{
+			memcpy(&results[j], &hist, sizeof(hist));
+			initials[j] = initial;
+		}
+		else
+		{
+			print_results(msg_size, iterations);
+		}
+		end_raw_samples();
+	}
+
+	struct run_header end = {
+		.marker = RUN_HEADER_MARKER,
+	};
+	if (write_full(server_sock_fd, &end, sizeof(end)) != 0)
+	{
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	if (trace)
+	{
+		print_trace_results(all_trace_hists);
+		free(all_trace_hists);
+	}
+	free(msg);
+}
+
+/*
+ * Multi-threaded client (-t): each thread has its own connection, pinned to
+ * a CPU, and its own histograms, which are merged per message size once all
+ * the threads are done, to see how sending from several vCPUs at once
+ * scales.  The server needs -N for as many clients.
+ */
+struct client_thread
+{
+	pthread_t thread;
+	int index;
+	int fd;
+	int cpu;		// -1 to leave unpinned
+	struct histogram *results;	// per message size
+	tsc_t *initials;
+};
+
+int n_client_threads = 1;
+int client_cpus[CPU_SETSIZE];
+int n_client_cpus = 0;
+// client_cpus came from --cpus rather than default_cpu_list().
+bool client_cpus_given = false;
+
+// Parses a cpu list like 0-3,6 into client_cpus.
+int parse_cpu_list(const char *cpus_str)
+{
+	const char *ptr = cpus_str;
+	n_client_cpus = 0;
+	client_cpus_given = true;
+
+	for (;;)
+	{
+		char *end;
+		long first = strtol(ptr, &end, 10);
+		long last = first;
+		if (end == ptr || first < 0)
+		{
+			return -1;
+		}
+		if (*end == '-')
+		{
+			ptr = end + 1;
+			last = strtol(ptr, &end, 10);
+			if (end == ptr || last < first)
+			{
+				return -1;
+			}
+		}
+		if (last >= CPU_SETSIZE)
+		{
+			return -1;
+		}
+		for (long cpu=first; cpu<=last; cpu++)
+		{
+			if (n_client_cpus == CPU_SETSIZE)
+			{
+				return -1;
+			}
+			client_cpus[n_client_cpus++] = cpu;
+		}
+
+		if (*end == '\0')
+		{
+			return 0;
+		}
+		if (*end != ',')
+		{
+			return -1;
+		}
+		ptr = end + 1;
+	}
+}
+
+// Without --cpus, the threads go round the cpus we're allowed to run on (so
+// an outer taskset still applies).
+int default_cpu_list()
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		perror("sched_getaffinity");
+		return -1;
+	}
+	n_client_cpus = 0;
+	for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET(cpu, &allowed))
+		{
+			client_cpus[n_client_cpus++] = cpu;
+		}
+	}
+	return 0;
+}
+
+int pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0)
+	{
+		fprintf(stderr, "pthread_setaffinity_np(cpu %d): %s\n", cpu, strerror(err));
+		return -1;
+	}
+	// Only for cpus given with --cpus, not the default spread over the
+	// allowed ones.
+	if (client_cpus_given)
+	{
+		warn_cpu_tuning(cpu);
+	}
+	return 0;
+}
+
+void *client_thread_main(void *opaque)
+{
+	struct client_thread *t = opaque;
+
+	if (t->cpu >= 0 && pin_to_cpu(t->cpu) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	if (recv_mode_setup(t->fd) != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	run_client_session(t->fd, t->results, t->initials);
+	return NULL;
+}
+
+void run_client(int *server_sock_fds)
+{
+	if (n_client_threads == 1)
+	{
+		if (n_client_cpus > 0 && pin_to_cpu(client_cpus[0]) != 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		if (recv_mode_setup(server_sock_fds[0]) != 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		run_client_session(server_sock_fds[0], NULL, NULL);
+		return;
+	}
+
+	if (n_client_cpus == 0 && default_cpu_list() != 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	struct client_thread *threads = calloc(n_client_threads, sizeof(*threads));
+	if (!threads)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<n_client_threads; i++)
+	{
+		struct client_thread *t = &threads[i];
+		t->index = i;
+		t->fd = server_sock_fds[i];
+		t->cpu = n_client_cpus > 0 ? client_cpus[i % n_client_cpus] : -1;
+		t->results = malloc(n_msg_sizes * sizeof(struct histogram));
+		t->initials = calloc(n_msg_sizes, sizeof(tsc_t));
+		if (!t->results || !t->initials)
+		{
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		pthread_create(&t->thread, NULL, client_thread_main, t);
+	}
+	for (int i=0; i<n_client_threads; i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	for (int j=0; j<n_msg_sizes; j++)
+	{
+		hist_reset(&hist);
+		initial = 0;
+		for (int i=0; i<n_client_threads; i++)
+		{
+			struct histogram *h = &threads[i].results[j];
+			fprintf(stderr, "thread %d (cpu %d) size %u: p50 %llu p99 %llu max %llu\n",
+				i, threads[i].cpu, msg_sizes[j], hist_percentile(h, 50), hist_percentile(h, 99), h->max);
+			hist_merge(&hist, h);
+			// The worst initial connection/send of them all.
+			initial = threads[i].initials[j] > initial ? threads[i].initials[j] : initial;
+		}
+		print_results(msg_sizes[j], iterations);
+	}
+
+	for (int i=0; i<n_client_threads; i++)
+	{
+		free(threads[i].results);
+		free(threads[i].initials);
+	}
+	free(threads);
+}
+
+/*
+ * Connection churn (--churn <n>): the client connects, sends one message
+ * with the tsc it started connecting at and waits for the server to close,
+ * n times over, while the server loops on accept().  The server closing
+ * first leaves TIME_WAIT on its side rather than eating the client's
+ * ephemeral ports.  The client times connect(), the server the first
+ * byte's arrival from the start of that connect() (so across VMs it needs
+ * the tsc-offset like any other one-way sample) and how long it held each
+ * connection from accept() to close().
+ */
+void run_churn_server(int listen_fd, int (*accept_client)(int, struct peer_id *), long long client_tsc_offset)
+{
+	struct histogram *first_byte_hist = calloc(1, sizeof(*first_byte_hist));
+	struct histogram *held_hist = calloc(1, sizeof(*held_hist));
+	if (!first_byte_hist || !held_hist)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	hist_reset(first_byte_hist);
+	hist_reset(held_hist);
+
+	tsc_t first_accept = 0;
+	tsc_t last_close = 0;
+	for (unsigned int i=0; i<churn_cycles; i++)
+	{
+		struct peer_id peer = { .name = "" };
+		int fd = accept_client(listen_fd, &peer);
+		if (fd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		tsc_t accepted = begin_rdtsc();
+		if (i == 0)
+		{
+			first_accept = accepted;
+			if (auto_tsc_offset && resolve_tsc_offset(&peer, &client_tsc_offset) != 0)
+			{
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		tsc_t client_connect_tsc;
+		if (read_full(fd, &client_connect_tsc, sizeof(client_connect_tsc)) != 0)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		tsc_t received = end_rdtsc();
+		close(fd);
+		last_close = end_rdtsc();
+
+		hist_record(first_byte_hist, received - client_connect_tsc + client_tsc_offset);
+		hist_record(held_hist, last_close - accepted);
+	}
+
+	print_hist_header("latency");
+	print_hist_row("first-byte", CLIENT_MESSAGE_LENGTH, 1, first_byte_hist);
+	print_hist_row("accept-to-close", CLIENT_MESSAGE_LENGTH, 1, held_hist);
+	fprintf(stdout, "connections/s: %.1f\n", churn_cycles / ((last_close - first_accept) / tsc_hz));
+
+	free(first_byte_hist);
+	free(held_hist);
+}
+
+void run_churn_client(int (*connect_server)(const char *), const char *server_arg)
+{
+	struct histogram *connect_hist = calloc(1, sizeof(*connect_hist));
+	if (!connect_hist)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	hist_reset(connect_hist);
+
+	tsc_t start = begin_rdtsc();
+	for (unsigned int i=0; i<churn_cycles; i++)
+	{
+		tsc_t connect_begin = begin_rdtsc();
+		int fd = connect_server(server_arg);
+		tsc_t connected = end_rdtsc();
+		if (fd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+		hist_record(connect_hist, connected - connect_begin);
+
+		if (write_full(fd, &connect_begin, sizeof(connect_begin)) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		// Wait for the server's close.
+		char eof;
+		ssize_t nbytes;
+		while ((nbytes = read(fd, &eof, sizeof(eof))) < 0 && errno == EINTR)
+		{
+		}
+		if (nbytes != 0)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+	}
+	double elapsed_sec = (end_rdtsc() - start) / tsc_hz;
+
+	print_hist_header("latency");
+	print_hist_row("connect", CLIENT_MESSAGE_LENGTH, 1, connect_hist);
+	fprintf(stdout, "connections/s: %.1f\n", churn_cycles / elapsed_sec);
+
+	free(connect_hist);
+}
+
+
+// Summary of the samples recorded for n iterations (the first of which is
+// reported separately as the initial connection/send).  Sweeps get one row
+// per message size, and -r adds a dump of every sample.
+void print_results(uint32_t msg_size, unsigned int n)
+{
+	if (raw_print)
+	{
+		for (unsigned int i=1; i<n; i++)
+		{
+			fprintf(stdout, "%4u: %llu\n", i, ticks[i]);
+		}
+	}
+
+	write_summary("", msg_size, initial, &hist);
+
+	// What batching bought: the cost of each send (client) or read (server)
+	// syscall, and how it amortizes over the messages it carried.
+	if (batch_size > 1 && syscall_hist.count > 0)
+	{
+		long double per_msg = syscall_hist.sum / n;
+		if (raw_file_info.is_server)
+		{
+			fprintf(stderr, "batch %u: read p50 %llu p99 %llu ticks, %.2f reads/batch, %.1f ns/msg\n",
+				batch_size, hist_percentile(&syscall_hist, 50), hist_percentile(&syscall_hist, 99),
+				(double)n_read_calls / syscall_hist.count, tsc_to_ns(per_msg));
+		}
+		else
+		{
+			fprintf(stderr, "batch %u: send p50 %llu p99 %llu ticks, %.1f ns/msg\n",
+				batch_size, hist_percentile(&syscall_hist, 50), hist_percentile(&syscall_hist, 99),
+				tsc_to_ns(per_msg));
+		}
+	}
+
+	print_summary(msg_size, initial, &hist);
+	print_perf(msg_size, n);
+	print_timeline(msg_size);
+}
+
+void print_usage(const char * msg)
+{
+	fprintf(stderr, "%s\n%s\n", msg,
+		"usage: vsock-oneway-latency-benchmark -m <vsock|unix|inet|shm|pipe> [options] <-s <client-tsc-offset|auto|sync>|-c <server-cid|unix-sock-path|ipaddr|shm-path|pipe-path>>\n"
+		"  -m shm|pipe                baselines without sockets: a shared memory ring\n"
+		"                             (" SERVER_SHM_PATH ") or a pair of\n"
+		"                             fifos (" SERVER_PIPE_PATH ".to-*)\n"
+		"  -p, --port <port>          vsock/inet port (default: 12345)\n"
+		"  -r, --raw                  also keep and print every sample (8 bytes each)\n"
+		"      --raw-file <path>      keep every sample in a binary file instead\n"
+		"      --csv <path>           also write the summaries as csv\n"
+		"      --json <path>          also write the summaries as json\n"
+		"      --recv-mode <mode>     wait for reads by blocking (default), epoll, or\n"
+		"                             busy polling with MSG_DONTWAIT and SO_BUSY_POLL\n"
+		"                             (shm: a futex or spinning on the ring)\n"
+		"      --sock-type <type>     stream (default) or seqpacket (vsock/unix)\n"
+		"      --churn <n>            (on both sides) connect, send one message and\n"
+		"                             close n times, timing connect(), the first byte\n"
+		"                             and accept() to close(), and connections/s\n"
+		"      --warmup <n|time>      untimed messages before each message size, a count\n"
+		"                             or a duration like 2s or 500ms (client only)\n"
+		"      --fifo <prio>          run SCHED_FIFO at that priority (1-99)\n"
+		"      --mlock                mlockall() current and future memory\n"
+		"      --cpu <n>              pin the benchmark thread to cpu n, warning if it\n"
+		"                             isn't isolated or uses a non-performance governor\n"
+		"      --perf                 count context switches, cpu migrations, page\n"
+		"                             faults, cache misses, instructions and cycles\n"
+		"                             (perf_event_open) and report them per iteration\n"
+		"      --perf-outliers <ticks> also per sample, comparing those over ticks with\n"
+		"                             the rest (implies --perf)\n"
+		"      --timeline <time|n>    also report p50, p99 and max per window of the\n"
+		"                             run, a duration like 100ms or 1s, or n samples\n"
+		"server only:\n"
+		"  -s auto                    look up each vsock client's tsc-offset in debugfs\n"
+		"                             (by its host vm id or the VMM's guest-cid=)\n"
+		"  -s sync                    estimate the tsc-offset (and drift) in-band ahead\n"
+		"                             of each run, over any transport\n"
+		"  -N, --clients <n>          serve n clients at once (eg: one per VM) with\n"
+		"                             epoll, reporting per peer and overall results\n"
+		"  -W, --workers <n>          with --clients, threads to spread them over\n"
+		"                             (default: 1)\n"
+		"client only (the server follows the client's settings):\n"
+		"  -n, --iterations <n>       messages per message size (default: 1000000)\n"
+		"  -l, --msg-size <bytes>     message size, at least 8 (default: 8)\n"
+		"  -w, --sweep <sizes>        run each of a list (8,100,1K) or the powers of two\n"
+		"                             in a range (8-64K) of message sizes over one\n"
+		"                             connection, printing a stats row per size\n"
+		"  -R, --rate <msgs/s>        open loop: send on a fixed schedule instead of\n"
+		"                             waiting for each ack, timing from the intended\n"
+		"                             send time (coordinated omission correction)\n"
+		"  -i, --inflight <n>         with --rate, most unacked messages (default: 64)\n"
+		"  -b, --batch <k>            send k messages per writev()/sendmmsg() and wait\n"
+		"                             for one ack per batch (default: 1)\n"
+		"  -t, --threads <n>          send from n threads, each with its own connection\n"
+		"                             (the server needs -N), pinned to a cpu, and merge\n"
+		"                             their results (default: 1)\n"
+		"      --cpus <list>          cpus to pin the threads to in turn, like 0-3,6\n"
+		"                             (default: those we're allowed to run on)\n"
+		"      --trials <m>           time m runs of each message size and report\n"
+		"                             their merged stats, with bootstrapped 95% CIs\n"
+		"                             for the p50 and p99 over the trials\n"
+		"      --converge <pct>       stop the trials once both CIs are within pct%\n"
+		"                             of their estimates (--trials is the most then,\n"
+		"                             default: 30)\n"
+		"      --trace                also break each round trip down into stages\n"
+		"                             (client write, to server wakeup, server read,\n"
+		"                             server to ack, ack return) with a histogram each");
+}
+
+// Long-only options.
+enum
+{
+	OPT_RECV_MODE = 256,
+	OPT_SOCK_TYPE,
+	OPT_CPUS,
+	OPT_RAW_FILE,
+	OPT_CSV,
+	OPT_JSON,
+	OPT_CHURN,
+	OPT_TRACE,
+	OPT_PERF,
+	OPT_PERF_OUTLIERS,
+	OPT_WARMUP,
+	OPT_TRIALS,
+	OPT_CONVERGE,
+	OPT_FIFO,
+	OPT_MLOCK,
+	OPT_CPU,
+	OPT_TIMELINE,
+};
+
+int main(int argc, char** argv)
+{
+	static const struct option long_options[] = {
+		{ "port", required_argument, NULL, 'p' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "msg-size", required_argument, NULL, 'l' },
+		{ "sweep", required_argument, NULL, 'w' },
+		{ "raw", no_argument, NULL, 'r' },
+		{ "rate", required_argument, NULL, 'R' },
+		{ "inflight", required_argument, NULL, 'i' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "recv-mode", required_argument, NULL, OPT_RECV_MODE },
+		{ "sock-type", required_argument, NULL, OPT_SOCK_TYPE },
+		{ "clients", required_argument, NULL, 'N' },
+		{ "workers", required_argument, NULL, 'W' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "cpus", required_argument, NULL, OPT_CPUS },
+		{ "raw-file", required_argument, NULL, OPT_RAW_FILE },
+		{ "csv", required_argument, NULL, OPT_CSV },
+		{ "json", required_argument, NULL, OPT_JSON },
+		{ "churn", required_argument, NULL, OPT_CHURN },
+		{ "trace", no_argument, NULL, OPT_TRACE },
+		{ "perf", no_argument, NULL, OPT_PERF },
+		{ "perf-outliers", required_argument, NULL, OPT_PERF_OUTLIERS },
+		{ "warmup", required_argument, NULL, OPT_WARMUP },
+		{ "trials", required_argument, NULL, OPT_TRIALS },
+		{ "converge", required_argument, NULL, OPT_CONVERGE },
+		{ "fifo", required_argument, NULL, OPT_FIFO },
+		{ "mlock", no_argument, NULL, OPT_MLOCK },
+		{ "cpu", required_argument, NULL, OPT_CPU },
+		{ "timeline", required_argument, NULL, OPT_TIMELINE },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	enum MODE
+	{
+		VSOCK,
+		UNIX,
+		INET,
+		SHM,
+		PIPE,
+	} mode = VSOCK;
+	bool have_mode = false;
+	const char *server_arg = NULL;
+	const char *client_arg = NULL;
+	const char *csv_path = NULL;
+	const char *json_path = NULL;
+	int opt;
+
+	msg_sizes[0] = CLIENT_MESSAGE_LENGTH;
+	min_msg_size = sizeof(tsc_t);
+	server_unix_path = SERVER_UNIX_PATH;
+
+	while ((opt = getopt_long(argc, argv, "m:s:c:p:n:l:w:rR:i:b:N:W:t:", long_options, NULL)) != -1)
+	{
+		char *end;
+		long size;
+
+		switch (opt)
+		{
+			case 'm':
+				have_mode = true;
+				if (strcmp(optarg, "vsock") == 0)
+				{
+					mode = VSOCK;
+				}
+				else if (strcmp(optarg, "unix") == 0)
+				{
+					mode = UNIX;
+				}
+				else if (strcmp(optarg, "inet") == 0)
+				{
+					mode = INET;
+				}
+				else if (strcmp(optarg, "shm") == 0)
+				{
+					mode = SHM;
+				}
+				else if (strcmp(optarg, "pipe") == 0)
+				{
+					mode = PIPE;
+				}
+				else
+				{
+					print_usage("Unhandled mode argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				server_arg = optarg;
+				break;
+			case 'c':
+				client_arg = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				if (port <= 0)
+				{
+					print_usage("Invalid port argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				iterations = strtoul(optarg, &end, 10);
+				if (*end != '\0' || iterations == 0)
+				{
+					print_usage("Invalid iterations argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'l':
+				size = parse_size(optarg, &end);
+				if (*end != '\0' || !valid_msg_size(size))
+				{
+					print_usage("Invalid message size argument.");
+					return EXIT_FAILURE;
+				}
+				msg_sizes[0] = size;
+				n_msg_sizes = 1;
+				sweep = false;
+				break;
+			case 'w':
+				if (parse_sweep(optarg) != 0)
+				{
+					print_usage("Invalid sweep argument.");
+					return EXIT_FAILURE;
+				}
+				sweep = true;
+				break;
+			case 'r':
+				raw = true;
+				raw_print = true;
+				break;
+			case OPT_RAW_FILE:
+				raw = true;
+				raw_file_path = optarg;
+				break;
+			case OPT_CSV:
+				csv_path = optarg;
+				break;
+			case OPT_JSON:
+				json_path = optarg;
+				break;
+			case OPT_CHURN:
+				churn_cycles = strtoul(optarg, &end, 10);
+				if (*end != '\0' || churn_cycles == 0)
+				{
+					print_usage("Invalid churn argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_TRACE:
+				trace = true;
+				break;
+			case OPT_WARMUP:
+				if (parse_warmup(optarg) != 0)
+				{
+					print_usage("Invalid warmup argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_TRIALS:
+				n_trials = strtoul(optarg, &end, 10);
+				if (*end != '\0' || n_trials == 0)
+				{
+					print_usage("Invalid trials argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_CONVERGE:
+				converge_pct = strtod(optarg, &end);
+				if (*end != '\0' || converge_pct <= 0)
+				{
+					print_usage("Invalid converge argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_FIFO:
+				rt_fifo_priority = strtol(optarg, &end, 10);
+				if (*end != '\0' || rt_fifo_priority < 1 || rt_fifo_priority > 99)
+				{
+					print_usage("Invalid fifo argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_MLOCK:
+				rt_mlock = true;
+				break;
+			case OPT_CPU:
+				rt_cpu = strtol(optarg, &end, 10);
+				if (*end != '\0' || rt_cpu < 0 || rt_cpu >= CPU_SETSIZE)
+				{
+					print_usage("Invalid cpu argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_TIMELINE:
+				if (parse_timeline(optarg) != 0)
+				{
+					print_usage("Invalid timeline argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_PERF:
+				perf_enabled = true;
+				break;
+			case OPT_PERF_OUTLIERS:
+				perf_outlier_ticks = strtoull(optarg, &end, 10);
+				if (*end != '\0' || perf_outlier_ticks == 0)
+				{
+					print_usage("Invalid perf-outliers argument.");
+					return EXIT_FAILURE;
+				}
+				perf_enabled = true;
+				break;
+			case 'R':
+				target_rate = strtod(optarg, &end);
+				if (*end != '\0' || target_rate <= 0)
+				{
+					print_usage("Invalid rate argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'i':
+				max_inflight = strtoul(optarg, &end, 10);
+				if (*end != '\0' || max_inflight == 0)
+				{
+					print_usage("Invalid inflight argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'b':
+				batch_size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || batch_size == 0 || batch_size > MAX_BATCH_SIZE)
+				{
+					print_usage("Invalid batch argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'N':
+				n_server_clients = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_server_clients <= 0)
+				{
+					print_usage("Invalid clients argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'W':
+				n_server_workers = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_server_workers <= 0)
+				{
+					print_usage("Invalid workers argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't':
+				n_client_threads = strtol(optarg, &end, 10);
+				if (*end != '\0' || n_client_threads <= 0)
+				{
+					print_usage("Invalid threads argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_CPUS:
+				if (parse_cpu_list(optarg) != 0)
+				{
+					print_usage("Invalid cpus argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_SOCK_TYPE:
+				if (parse_sock_type(optarg) != 0)
+				{
+					print_usage("Invalid sock-type argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_RECV_MODE:
+				if (parse_recv_mode(optarg) != 0)
+				{
+					print_usage("Invalid recv-mode argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				print_usage("Invalid argument.");
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (!have_mode || optind != argc || (server_arg == NULL) == (client_arg == NULL))
+	{
+		print_usage("Invalid number/type/order of arguments.");
+		return EXIT_FAILURE;
+	}
+	const struct transport_ops *transports[] = {
+		[VSOCK] = &vsock_transport,
+		[UNIX] = &unix_transport,
+		[INET] = &inet_transport,
+		[SHM] = &shm_transport,
+		[PIPE] = &pipe_transport,
+	};
+	transport = transports[mode];
+	quiet_accept = churn_cycles > 0;
+	if (raw && (n_client_threads > 1 || (server_arg && n_server_clients > 0)))
+	{
+		print_usage("Raw samples aren't kept with multiple client threads or server clients.");
+		return EXIT_FAILURE;
+	}
+	if (batch_size > 1 && target_rate > 0)
+	{
+		print_usage("--batch and --rate don't mix.");
+		return EXIT_FAILURE;
+	}
+	if (churn_cycles > 0 && (raw || sweep || msg_sizes[0] != CLIENT_MESSAGE_LENGTH || batch_size > 1 ||
+		target_rate > 0 || n_client_threads > 1 || n_server_clients > 0 || recv_mode != RECV_BLOCKING))
+	{
+		print_usage("--churn sends one 8 byte message per connection with blocking reads (no -r, -l, -w, -b, --rate, -t, -N or --recv-mode).");
+		return EXIT_FAILURE;
+	}
+	if (trace && (batch_size > 1 || target_rate > 0 || n_client_threads > 1 || churn_cycles > 0))
+	{
+		print_usage("--trace times one message at a time from a single closed loop client (no -b, --rate, -t or --churn).");
+		return EXIT_FAILURE;
+	}
+	if (trials_init() != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	bool controlled = n_trials > 1 || warmup_iterations > 0 || warmup_sec > 0;
+	if (controlled && (n_client_threads > 1 || churn_cycles > 0 || (n_trials > 1 && raw_print)))
+	{
+		print_usage("--warmup and --trials run over a single client connection (no -t or --churn, and --trials doesn't print -r samples).");
+		return EXIT_FAILURE;
+	}
+	if (rt_cpu >= 0 && (n_client_threads > 1 || n_client_cpus > 0 || n_server_workers > 1))
+	{
+		print_usage("--cpu pins the one benchmark thread (use --cpus with -t, and no -W).");
+		return EXIT_FAILURE;
+	}
+	if (perf_enabled && (target_rate > 0 || n_client_threads > 1 || (server_arg && n_server_clients > 0) || churn_cycles > 0))
+	{
+		print_usage("--perf counts the one benchmark thread (no --rate, -t, -N or --churn).");
+		return EXIT_FAILURE;
+	}
+	if (timeline_enabled && (n_client_threads > 1 || (server_arg && n_server_clients > 0) || churn_cycles > 0))
+	{
+		print_usage("--timeline follows the one benchmark thread's samples (no -t, -N or --churn).");
+		return EXIT_FAILURE;
+	}
+	if (open_summary_files(csv_path, json_path) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	raw_file_info.mode = mode;
+	raw_file_info.is_server = server_arg != NULL;
+
+	auto_tsc_offset = server_arg && strcmp(server_arg, "auto") == 0;
+	sync_tsc_offset = server_arg && strcmp(server_arg, "sync") == 0;
+	if (sync_tsc_offset && (n_server_clients > 0 || churn_cycles > 0))
+	{
+		print_usage("-s sync needs a single client server (no -N or --churn).");
+		return EXIT_FAILURE;
+	}
+	if (sock_type != SOCK_STREAM && mode == INET)
+	{
+		print_usage("inet only supports stream sockets.");
+		return EXIT_FAILURE;
+	}
+	if (auto_tsc_offset && mode != VSOCK)
+	{
+		print_usage("-s auto needs -m vsock.");
+		return EXIT_FAILURE;
+	}
+	if (mode == SHM || mode == PIPE)
+	{
+		if (sock_type != SOCK_STREAM || target_rate > 0 || n_client_threads > 1 || (server_arg && n_server_clients > 0))
+		{
+			print_usage("shm and pipe are single client stream baselines (no --sock-type, --rate, -t or -N).");
+			return EXIT_FAILURE;
+		}
+		if (churn_cycles > 0)
+		{
+			print_usage("--churn needs a socket mode.");
+			return EXIT_FAILURE;
+		}
+		if (mode == SHM && recv_mode == RECV_EPOLL)
+		{
+			print_usage("shm waits with a futex (blocking) or by spinning (busy), not epoll.");
+			return EXIT_FAILURE;
+		}
+	}
+
+	tsc_init();
+	if (rt_setup() != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (perf_enabled && perf_open() != 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	if (server_arg && (n_server_clients > 0 || churn_cycles > 0))
+	{
+		long long client_tsc_offset = auto_tsc_offset ? 0 : parse_client_tsc_offset(server_arg);
+		if (client_tsc_offset == -1)
+		{
+			print_usage("Failed to parse client_tsc_offset argument.");
+			return EXIT_FAILURE;
+		}
+
+		int listen_fd = transport->listen(churn_cycles > 0 ? SOMAXCONN : n_server_clients);
+		if (listen_fd < 0)
+		{
+			return EXIT_FAILURE;
+		}
+
+		if (churn_cycles > 0)
+		{
+			run_churn_server(listen_fd, transport->accept, client_tsc_offset);
+			close(listen_fd);
+		}
+		else
+		{
+			run_multi_server(listen_fd, transport->accept, client_tsc_offset);
+		}
+
+		if (mode == UNIX)
+		{
+			unlink(SERVER_UNIX_PATH);
+		}
+	}
+	else if (server_arg)
+	{
+		struct peer_id peer = { .name = "" };
+		int client_sock_fd = listen_and_accept_single_client_connection(transport, &peer);
+		if (client_sock_fd < 0 || recv_mode_setup(client_sock_fd) != 0)
+		{
+			return EXIT_FAILURE;
+		}
+
+		// -s sync leaves it to sync_clock().
+		long long client_tsc_offset = 0;
+		if (auto_tsc_offset)
+		{
+			if (resolve_tsc_offset(&peer, &client_tsc_offset) != 0)
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if (!sync_tsc_offset)
+		{
+			client_tsc_offset = parse_client_tsc_offset(server_arg);
+			if (client_tsc_offset == -1)
+			{
+				print_usage("Failed to parse client_tsc_offset argument.");
+				return EXIT_FAILURE;
+			}
+		}
+
+		raw_file_info.cid = peer.cid;
+		raw_file_info.tsc_offset = client_tsc_offset;
+		run_server(client_sock_fd, client_tsc_offset);
+
+		if (mode == UNIX)
+		{
+			unlink(SERVER_UNIX_PATH);
+		}
+		else if (mode == SHM)
+		{
+			unlink(SERVER_SHM_PATH);
+		}
+		else if (mode == PIPE)
+		{
+			pipe_unlink();
+		}
+	}
+	else if (churn_cycles > 0)
+	{
+		run_churn_client(transport->connect, client_arg);
+	}
+	else
+	{
+		int *server_sock_fds = calloc(n_client_threads, sizeof(int));
+		if (!server_sock_fds)
+		{
+			perror("calloc");
+			return EXIT_FAILURE;
+		}
+
+		if (mode == VSOCK)
+		{
+			raw_file_info.cid = parse_cid(client_arg);
+		}
+
+		// One connection per client thread.  The arg is expected to
+		// typically be 2 for the host cid constant (vsock),
+		// SERVER_UNIX_PATH, 127.0.0.1 (inet), SERVER_SHM_PATH or
+		// SERVER_PIPE_PATH.
+		for (int i=0; i<n_client_threads; i++)
+		{
+			server_sock_fds[i] = transport->connect(client_arg);
+			if (server_sock_fds[i] < 0)
+			{
+				return EXIT_FAILURE;
+			}
+		}
+
+		run_client(server_sock_fds);
+		free(server_sock_fds);
 	}
 
-	print_results();
+	close_output_files();
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,716 @@
+/**
+ * vsock-throughput-benchmark.c
+ *
+ * A simple tool for measuring the sustained bandwidth of a vsock connection
+ * between a VM and its host, for comparison with unix and inet sockets.
+ *
+ * The latency benchmarks only ever exchange a few bytes at a time, which
+ * says little about bulk traffic (eg: snapshot or log streams pushed through
+ * nc-vsock).  Here the client opens one or more streams to the server and
+ * writes as fast as it can for a fixed duration or number of bytes.  The
+ * server counts what arrives and, once every stream has hit EOF, reports
+ * the total back to the client so both ends time the same transfer.
+ *
+ * Each side reports bytes moved, wall time, GB/s and the CPU time (user +
+ * system, all threads) it spent per GB.
+ *
+ * The client can send with plain write()s, with vmsplice()/splice() through
+ * a pipe, or with MSG_ZEROCOPY where the socket supports it.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/vm_sockets.h>
+
+#include "vsock-bench.h"
+#include "vsock-transport.h"
+
+#define SERVER_UNIX_PATH "/tmp/vsock-throughput-benchmark.sock"
+#define DEFAULT_WRITE_SIZE (128 * 1024)
+#define DEFAULT_DURATION_SEC 10
+#define MAX_STREAMS 256
+#define DEFAULT_ZEROCOPY_MIN (16 * 1024)
+// Buffers each zerocopy stream rotates through, see send_zerocopy()
+#define ZC_BUFFERS 8
+
+// Sent by the client at the start of every stream.
+#define STREAM_HELLO_MAGIC 0x76736f636b747075ULL
+
+struct stream_hello
+{
+	uint64_t magic;
+	uint32_t stream;
+	uint32_t nstreams;
+};
+
+enum SENDER
+{
+	SENDER_WRITE,
+	SENDER_SPLICE,
+	SENDER_ZEROCOPY,
+};
+
+struct stream
+{
+	pthread_t thread;
+	int index;
+	int fd;
+	uint64_t bytes;
+	uint64_t zc_sends;
+	uint64_t zc_completions;
+	uint64_t zc_copied;
+	uint64_t zc_small;	// below -z, sent with write()
+	uint64_t zc_fallbacks;	// ENOBUFS, sent with write()
+};
+
+enum SENDER sender = SENDER_WRITE;
+size_t write_size = DEFAULT_WRITE_SIZE;
+int nstreams = 1;
+uint64_t stream_bytes = 0;
+double duration_sec = DEFAULT_DURATION_SEC;
+uint64_t zerocopy_min = DEFAULT_ZEROCOPY_MIN;
+struct timespec deadline;
+
+double now_sec(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_sec()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+void *server_stream(void *opaque)
+{
+	struct stream *stream = opaque;
+	char *buf = malloc(write_size);
+	if (!buf)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;)
+	{
+		ssize_t nbytes = read(stream->fd, buf, write_size);
+		if (nbytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (nbytes < 0)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		else if (nbytes == 0)
+		{
+			break;
+		}
+		stream->bytes += nbytes;
+	}
+
+	// Tell the client how much arrived, which also marks the end of its timing.
+	if (write_full(stream->fd, &stream->bytes, sizeof(stream->bytes)) != 0)
+	{
+		perror("write");
+	}
+
+	free(buf);
+	return NULL;
+}
+
+bool client_done(uint64_t sent)
+{
+	if (stream_bytes)
+	{
+		return sent >= stream_bytes;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec > deadline.tv_sec ||
+	       (ts.tv_sec == deadline.tv_sec && ts.tv_nsec >= deadline.tv_nsec);
+}
+
+size_t client_chunk(uint64_t sent)
+{
+	if (stream_bytes && stream_bytes - sent < write_size)
+	{
+		return stream_bytes - sent;
+	}
+	return write_size;
+}
+
+void send_write(struct stream *stream, const char *buf)
+{
+	while (!client_done(stream->bytes))
+	{
+		ssize_t nbytes = write(stream->fd, buf, client_chunk(stream->bytes));
+		if (nbytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (nbytes <= 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		stream->bytes += nbytes;
+	}
+}
+
+void send_splice(struct stream *stream, char *buf)
+{
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0)
+	{
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, write_size);
+
+	while (!client_done(stream->bytes))
+	{
+		struct iovec iov = {
+			.iov_base = buf,
+			.iov_len = client_chunk(stream->bytes),
+		};
+		ssize_t in_pipe = vmsplice(pipe_fds[1], &iov, 1, 0);
+		if (in_pipe < 0)
+		{
+			perror("vmsplice");
+			exit(EXIT_FAILURE);
+		}
+
+		while (in_pipe > 0)
+		{
+			ssize_t nbytes = splice(pipe_fds[0], NULL, stream->fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (nbytes <= 0)
+			{
+				perror("splice");
+				exit(EXIT_FAILURE);
+			}
+			in_pipe -= nbytes;
+			stream->bytes += nbytes;
+		}
+	}
+
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+// Reap MSG_ZEROCOPY completions from the socket error queue.
+void zerocopy_reap(struct stream *stream, bool wait)
+{
+	for (;;)
+	{
+		char control[128];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+
+		if (wait)
+		{
+			struct pollfd pfd = { .fd = stream->fd, .events = 0 };
+			poll(&pfd, 1, -1);
+		}
+
+		if (recvmsg(stream->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+			{
+				if (wait)
+				{
+					continue;
+				}
+				return;
+			}
+			perror("recvmsg");
+			exit(EXIT_FAILURE);
+		}
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			{
+				continue;
+			}
+			// ee_info..ee_data is the inclusive range of completed sends
+			stream->zc_completions += serr->ee_data - serr->ee_info + 1;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			{
+				stream->zc_copied += serr->ee_data - serr->ee_info + 1;
+			}
+		}
+		wait = false;
+	}
+}
+
+void send_zerocopy(struct stream *stream, const char *buf)
+{
+	int one = 1;
+
+	if (setsockopt(stream->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+	{
+		perror("setsockopt SO_ZEROCOPY");
+		fprintf(stderr, "%s\n", "Falling back to write().");
+		send_write(stream, buf);
+		return;
+	}
+
+	// Rotate through ZC_BUFFERS page aligned copies of the payload, reusing
+	// each only once the send that last used it has completed, as an
+	// application refilling its buffers would have to.
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t stride = (write_size + page - 1) & ~(page - 1);
+	char *pool;
+	if (posix_memalign((void **)&pool, page, stride * ZC_BUFFERS) != 0)
+	{
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<ZC_BUFFERS; i++)
+	{
+		memcpy(pool + i * stride, buf, write_size);
+	}
+	uint64_t last_send[ZC_BUFFERS] = { 0 };	// zc_sends after each buffer's last send
+	int slot = 0;
+
+	while (!client_done(stream->bytes))
+	{
+		size_t len = client_chunk(stream->bytes);
+		char *zc_buf = pool + slot * stride;
+		ssize_t nbytes;
+
+		if (len < zerocopy_min)
+		{
+			// pinning the pages costs more than copying this little
+			nbytes = write(stream->fd, zc_buf, len);
+			stream->zc_small++;
+		}
+		else
+		{
+			// Completions arrive in order, so that send is done once
+			// as many have completed.
+			while (stream->zc_completions < last_send[slot])
+			{
+				zerocopy_reap(stream, true);
+			}
+
+			nbytes = send(stream->fd, zc_buf, len, MSG_ZEROCOPY);
+			if (nbytes < 0 && errno == ENOBUFS)
+			{
+				// out of optmem for the notifications, copy this one
+				nbytes = write(stream->fd, zc_buf, len);
+				stream->zc_fallbacks++;
+			}
+			else if (nbytes > 0)
+			{
+				last_send[slot] = ++stream->zc_sends;
+				slot = (slot + 1) % ZC_BUFFERS;
+			}
+		}
+
+		if (nbytes < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (nbytes <= 0)
+		{
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		stream->bytes += nbytes;
+		zerocopy_reap(stream, false);
+	}
+
+	while (stream->zc_completions < stream->zc_sends)
+	{
+		zerocopy_reap(stream, true);
+	}
+	free(pool);
+}
+
+void *client_stream(void *opaque)
+{
+	struct stream *stream = opaque;
+	char *buf;
+
+	// page aligned so splice and zerocopy can take whole pages
+	if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), write_size) != 0)
+	{
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 'c', write_size);
+
+	switch (sender)
+	{
+		case SENDER_SPLICE:
+			send_splice(stream, buf);
+			break;
+		case SENDER_ZEROCOPY:
+			send_zerocopy(stream, buf);
+			break;
+		case SENDER_WRITE:
+		default:
+			send_write(stream, buf);
+			break;
+	}
+
+	if (shutdown(stream->fd, SHUT_WR) != 0)
+	{
+		perror("shutdown");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t received;
+	if (read_full(stream->fd, &received, sizeof(received)) != 0)
+	{
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+	if (received != stream->bytes)
+	{
+		fprintf(stderr, "stream %d: sent %lu bytes but server received %lu\n",
+			stream->index, stream->bytes, received);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+void print_results(struct stream *streams, double wall, double cpu)
+{
+	uint64_t total = 0;
+	uint64_t zc_sends = 0;
+	uint64_t zc_completions = 0;
+	uint64_t zc_copied = 0;
+	uint64_t zc_small = 0;
+	uint64_t zc_fallbacks = 0;
+
+	for (int i=0; i<nstreams; i++)
+	{
+		fprintf(stdout, "stream %d: %lu bytes\n", i, streams[i].bytes);
+		total += streams[i].bytes;
+		zc_sends += streams[i].zc_sends;
+		zc_completions += streams[i].zc_completions;
+		zc_copied += streams[i].zc_copied;
+		zc_small += streams[i].zc_small;
+		zc_fallbacks += streams[i].zc_fallbacks;
+	}
+
+	double gb = total / 1e9;
+	fprintf(stdout, "streams: %d\n", nstreams);
+	fprintf(stdout, "bytes: %lu\n", total);
+	fprintf(stdout, "seconds: %f\n", wall);
+	fprintf(stdout, "GB/s: %f\n", wall > 0 ? gb / wall : 0);
+	fprintf(stdout, "cpu seconds: %f\n", cpu);
+	fprintf(stdout, "cpu seconds/GB: %f\n", gb > 0 ? cpu / gb : 0);
+	if (sender == SENDER_ZEROCOPY && (zc_sends || zc_small || zc_fallbacks))
+	{
+		fprintf(stdout, "zerocopy sends: %lu\n", zc_sends);
+		fprintf(stdout, "zerocopy completions: %lu (copied: %lu)\n", zc_completions, zc_copied);
+		fprintf(stdout, "zerocopy below -z: %lu\n", zc_small);
+		fprintf(stdout, "zerocopy fallbacks: %lu\n", zc_fallbacks);
+	}
+}
+
+void run_server()
+{
+	struct stream streams[MAX_STREAMS];
+	struct peer_id peer;
+	int listen_fd = transport->listen(MAX_STREAMS);
+	int expected = 0;
+	int accepted = 0;
+
+	if (listen_fd < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	memset(streams, 0, sizeof(streams));
+	DEBUG_PRINT("Listening on port/path for %s ...\n", transport->name);
+
+	// The first stream tells us how many to wait for.  There is a
+	// connection per stream, so report the peer once below instead.
+	quiet_accept = true;
+	do
+	{
+		struct stream_hello hello;
+		int fd = transport->accept(listen_fd, &peer);
+		if (fd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+
+		if (read_full(fd, &hello, sizeof(hello)) != 0 || hello.magic != STREAM_HELLO_MAGIC ||
+		    hello.nstreams == 0 || hello.nstreams > MAX_STREAMS || hello.stream >= hello.nstreams ||
+		    (expected && hello.nstreams != (uint32_t)expected) || streams[hello.stream].fd)
+		{
+			fprintf(stderr, "%s\n", "Ignoring connection with a bad stream header.");
+			close(fd);
+			continue;
+		}
+
+		expected = hello.nstreams;
+		streams[hello.stream].index = hello.stream;
+		streams[hello.stream].fd = fd;
+		accepted++;
+	} while (accepted < expected);
+
+	close(listen_fd);
+	if (transport == &unix_transport)
+	{
+		unlink(SERVER_UNIX_PATH);
+	}
+
+	nstreams = expected;
+	fprintf(stderr, "Receiving %d stream(s) from %s ...\n", nstreams, peer.name);
+
+	double cpu_begin = cpu_sec();
+	double wall_begin = now_sec(CLOCK_MONOTONIC);
+
+	for (int i=0; i<nstreams; i++)
+	{
+		pthread_create(&streams[i].thread, NULL, server_stream, &streams[i]);
+	}
+	for (int i=0; i<nstreams; i++)
+	{
+		pthread_join(streams[i].thread, NULL);
+		close(streams[i].fd);
+	}
+
+	print_results(streams, now_sec(CLOCK_MONOTONIC) - wall_begin, cpu_sec() - cpu_begin);
+}
+
+void run_client(const char *target)
+{
+	struct stream streams[MAX_STREAMS];
+
+	memset(streams, 0, sizeof(streams));
+
+	for (int i=0; i<nstreams; i++)
+	{
+		struct stream_hello hello = {
+			.magic = STREAM_HELLO_MAGIC,
+			.stream = i,
+			.nstreams = nstreams,
+		};
+
+		streams[i].index = i;
+		streams[i].fd = transport->connect(target);
+		if (streams[i].fd < 0)
+		{
+			exit(EXIT_FAILURE);
+		}
+
+		if (write_full(streams[i].fd, &hello, sizeof(hello)) != 0)
+		{
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double cpu_begin = cpu_sec();
+	double wall_begin = now_sec(CLOCK_MONOTONIC);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += (time_t)duration_sec;
+	deadline.tv_nsec += (long)((duration_sec - (time_t)duration_sec) * 1e9);
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	for (int i=0; i<nstreams; i++)
+	{
+		pthread_create(&streams[i].thread, NULL, client_stream, &streams[i]);
+	}
+	for (int i=0; i<nstreams; i++)
+	{
+		pthread_join(streams[i].thread, NULL);
+		close(streams[i].fd);
+	}
+
+	print_results(streams, now_sec(CLOCK_MONOTONIC) - wall_begin, cpu_sec() - cpu_begin);
+}
+
+void print_usage(const char * msg)
+{
+	fprintf(stderr, "%s\n%s\n", msg,
+		"usage: vsock-throughput-benchmark -m <vsock|unix|inet> [options] <-s|-c <server-cid|unix-sock-path|ipaddr>>\n"
+		"  -p <port>        vsock/inet port (default: 12345)\n"
+		"  -w <bytes>       write (client) / read (server) size (default: 128K)\n"
+		"  -P <streams>     parallel streams, client only (default: 1)\n"
+		"  -d <seconds>     run for this long, client only (default: 10)\n"
+		"  -n <bytes>       send this much per stream instead of -d, client only\n"
+		"  -x <write|splice|zerocopy>\n"
+		"                   how the client sends (default: write)\n"
+		"  -z <bytes>       with -x zerocopy, write() chunks smaller than this\n"
+		"                   (default: 16K)\n"
+		"  sizes take an optional K, M or G suffix");
+}
+
+int main(int argc, char** argv)
+{
+	const char *target = NULL;
+	bool server = false;
+	bool have_mode = false;
+	char *end;
+	long size;
+	int opt;
+
+	server_unix_path = SERVER_UNIX_PATH;
+
+	while ((opt = getopt(argc, argv, "m:sc:p:w:P:d:n:x:z:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'm':
+				have_mode = true;
+				if (strcmp(optarg, "vsock") == 0)
+				{
+					transport = &vsock_transport;
+				}
+				else if (strcmp(optarg, "unix") == 0)
+				{
+					transport = &unix_transport;
+				}
+				else if (strcmp(optarg, "inet") == 0)
+				{
+					transport = &inet_transport;
+				}
+				else
+				{
+					print_usage("Unhandled mode argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 's':
+				server = true;
+				break;
+			case 'c':
+				target = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				if (port <= 0)
+				{
+					print_usage("Invalid port.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'w':
+				size = parse_size(optarg, &end);
+				if (*end != '\0' || size <= 0)
+				{
+					print_usage("Invalid write size.");
+					return EXIT_FAILURE;
+				}
+				write_size = size;
+				break;
+			case 'P':
+				nstreams = atoi(optarg);
+				if (nstreams <= 0 || nstreams > MAX_STREAMS)
+				{
+					print_usage("Invalid number of streams.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'd':
+				duration_sec = atof(optarg);
+				if (duration_sec <= 0)
+				{
+					print_usage("Invalid duration.");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'n':
+				size = parse_size(optarg, &end);
+				if (*end != '\0' || size <= 0)
+				{
+					print_usage("Invalid byte count.");
+					return EXIT_FAILURE;
+				}
+				stream_bytes = size;
+				break;
+			case 'z':
+				size = parse_size(optarg, &end);
+				if (*end != '\0' || size <= 0)
+				{
+					print_usage("Invalid zerocopy minimum.");
+					return EXIT_FAILURE;
+				}
+				zerocopy_min = size;
+				break;
+			case 'x':
+				if (strcmp(optarg, "write") == 0)
+				{
+					sender = SENDER_WRITE;
+				}
+				else if (strcmp(optarg, "splice") == 0)
+				{
+					sender = SENDER_SPLICE;
+				}
+				else if (strcmp(optarg, "zerocopy") == 0)
+				{
+					sender = SENDER_ZEROCOPY;
+				}
+				else
+				{
+					print_usage("Unhandled sender argument.");
+					return EXIT_FAILURE;
+				}
+				break;
+			default:
+				print_usage("Invalid argument.");
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (!have_mode || optind != argc || server == (target != NULL))
+	{
+		print_usage("Invalid number/type/order of arguments.");
+		return EXIT_FAILURE;
+	}
+
+	if (server)
+	{
+		run_server();
+	}
+	else
+	{
+		run_client(target);
+	}
+
+	return EXIT_SUCCESS;
+}
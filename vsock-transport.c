@@ -0,0 +1,550 @@
+/**
+ * vsock-transport.c
+ *
+ * See vsock-transport.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/vm_sockets.h>
+
+#include "vsock-transport.h"
+
+// Spin loop hint for the busy polling reads.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax() do{ } while ( false )
+#endif
+
+int port = SERVER_LISTEN_PORT;
+int sock_type = SOCK_STREAM;
+const char *server_unix_path;
+bool quiet_accept = false;
+void (*vsock_socket_setup)(int fd);
+
+int parse_cid(const char *cid_str)
+{
+	char *end = NULL;
+	long cid = strtol(cid_str, &end, 10);
+	if (cid_str != end && *end == '\0') {
+		return cid;
+	} else {
+		fprintf(stderr, "invalid cid: %s\n", cid_str);
+		return -1;
+	}
+}
+
+int vsock_listen_port(unsigned int listen_port, int backlog)
+{
+	int listen_fd;
+
+	struct sockaddr_vm sa_listen = {
+		.svm_family = AF_VSOCK,
+		.svm_cid = VMADDR_CID_ANY,
+		.svm_port = listen_port,
+	};
+
+	listen_fd = socket(AF_VSOCK, sock_type, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (vsock_socket_setup) {
+		vsock_socket_setup(listen_fd);
+	}
+
+	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
+		perror("bind");
+		close(listen_fd);
+		return -1;
+	}
+
+	if (listen(listen_fd, backlog) != 0) {
+		perror("listen");
+		close(listen_fd);
+		return -1;
+	}
+
+	DEBUG_PRINT("%s\n", "Listening on vsock VMADDR_CID_ANY (2 for the host) ...");
+
+	return listen_fd;
+}
+
+static int vsock_listen_socket(int backlog)
+{
+	return vsock_listen_port(port, backlog);
+}
+
+static int vsock_accept_client(int listen_fd, struct peer_id *peer)
+{
+	int client_fd;
+	struct sockaddr_vm sa_client;
+	socklen_t socklen_client = sizeof(sa_client);
+
+	client_fd = accept4(listen_fd, (struct sockaddr*)&sa_client, &socklen_client, SOCK_CLOEXEC);
+	if (client_fd < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	// Only some transports (eg: VMCI) know the peer's host VM id, virtio
+	// doesn't implement the option.
+	int host_vm_id;
+	socklen_t host_vm_id_size = sizeof(host_vm_id);
+	if (getsockopt(client_fd, AF_VSOCK, SO_VM_SOCKETS_PEER_HOST_VM_ID, (void *)&host_vm_id, &host_vm_id_size) != 0)
+	{
+		if (errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+		{
+			perror("getsockopt");
+			close(client_fd);
+			return -1;
+		}
+		host_vm_id = -1;
+	}
+
+	if (!quiet_accept)
+	{
+		fprintf(stderr, "Connection from cid %u (id: %d, size: %u) port %u...\n", sa_client.svm_cid, host_vm_id, host_vm_id_size, sa_client.svm_port);
+	}
+
+	snprintf(peer->name, sizeof(peer->name), "cid %u", sa_client.svm_cid);
+	peer->cid = sa_client.svm_cid;
+	peer->host_vm_id = host_vm_id;
+	return client_fd;
+}
+
+static int unix_listen_socket(int backlog)
+{
+	int listen_fd;
+
+	struct sockaddr_un sa_listen = {
+		.sun_family = AF_UNIX,
+	};
+	strncpy(sa_listen.sun_path, server_unix_path, sizeof(sa_listen.sun_path)-1);
+	unlink(server_unix_path);
+
+	listen_fd = socket(AF_UNIX, sock_type, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
+		perror("bind");
+		close(listen_fd);
+		return -1;
+	}
+
+	if (listen(listen_fd, backlog) != 0) {
+		perror("listen");
+		close(listen_fd);
+		return -1;
+	}
+
+	DEBUG_PRINT("Listening at '%s' ...", server_unix_path);
+
+	return listen_fd;
+}
+
+static int unix_accept_client(int listen_fd, struct peer_id *peer)
+{
+	static int n_accepted = 0;
+	int client_fd;
+	struct sockaddr_un sa_client;
+	socklen_t socklen_client = sizeof(sa_client);
+
+	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
+	if (client_fd < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	if (!quiet_accept)
+	{
+		fprintf(stderr, "%s\n", "Connection from ... (not sure how to get the remote peer details offhand ...");
+	}
+
+	// Unnamed client sockets all look alike, so just number them.
+	snprintf(peer->name, sizeof(peer->name), "unix %d", n_accepted++);
+	return client_fd;
+}
+
+static int inet_listen_socket(int backlog)
+{
+	int listen_fd;
+
+	struct sockaddr_in sa_listen = {
+		.sin_family = AF_INET,
+		// Listen on all addrs so we can test both from loopback and across the network.
+		.sin_addr.s_addr = INADDR_ANY,
+		.sin_port = htons(port),
+	};
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	// Forcefully attaching socket to port (these are option names, not
+	// flags, so each needs its own call)
+	int opt = 1;
+	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0 ||
+	    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0)
+	{
+		perror("setsockopt");
+		close(listen_fd);
+		return -1;
+	}
+
+	if (bind(listen_fd, (struct sockaddr*)&sa_listen, sizeof(sa_listen)) != 0) {
+		perror("bind");
+		close(listen_fd);
+		return -1;
+	}
+
+	if (listen(listen_fd, backlog) != 0) {
+		perror("listen");
+		close(listen_fd);
+		return -1;
+	}
+
+	DEBUG_PRINT("Listening on inet '0.0.0.0' at port '%d' ...", port);
+
+	return listen_fd;
+}
+
+static int inet_accept_client(int listen_fd, struct peer_id *peer)
+{
+	int client_fd;
+	struct sockaddr_in sa_client;
+	socklen_t socklen_client = sizeof(sa_client);
+
+	client_fd = accept(listen_fd, (struct sockaddr*)&sa_client, &socklen_client);
+	if (client_fd < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	if (!quiet_accept)
+	{
+		fprintf(stderr, "Connection from client address '%s' at port %u ...\n", inet_ntoa(sa_client.sin_addr), ntohs(sa_client.sin_port));
+	}
+
+	snprintf(peer->name, sizeof(peer->name), "%s", inet_ntoa(sa_client.sin_addr));
+	return client_fd;
+}
+
+int vsock_connect_port(unsigned int cid, unsigned int server_port, int flags)
+{
+	DEBUG_PRINT("Client connecting to cid %u on port %u.\n", cid, server_port);
+
+	int fd;
+	struct sockaddr_vm sa = {
+		.svm_family = AF_VSOCK,
+		.svm_port = server_port,
+		.svm_cid = cid,
+	};
+
+	fd = socket(AF_VSOCK, sock_type | flags, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (vsock_socket_setup) {
+		vsock_socket_setup(fd);
+	}
+
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 &&
+	    !((flags & SOCK_NONBLOCK) && errno == EINPROGRESS)) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int vsock_connect(const char *server_cid_str)
+{
+	int server_cid = parse_cid(server_cid_str);
+
+	if (server_cid < 0) {
+		return -1;
+	}
+	return vsock_connect_port(server_cid, port, 0);
+}
+
+static int unix_connect(const char *path)
+{
+	DEBUG_PRINT("Client connecting to unix path '%s'.\n", path);
+
+	int fd;
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX,
+	};
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+
+	fd = socket(AF_UNIX, sock_type, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int inet_connect(const char *server_ip)
+{
+	DEBUG_PRINT("Client connecting to server ip '%s' on port %u.\n", server_ip, port);
+
+	int fd;
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+	};
+	if (inet_pton(AF_INET, server_ip, &sa.sin_addr) != 1)
+	{
+		perror("inet_pton");
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+enum recv_mode recv_mode = RECV_BLOCKING;
+__thread int recv_epfd = -1;
+
+// SO_BUSY_POLL time for --recv-mode busy, where the transport supports it.
+#define BUSY_POLL_USEC 50
+
+int parse_sock_type(const char *type_str)
+{
+	if (strcmp(type_str, "stream") == 0) {
+		sock_type = SOCK_STREAM;
+	} else if (strcmp(type_str, "seqpacket") == 0) {
+		sock_type = SOCK_SEQPACKET;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int parse_recv_mode(const char *mode_str)
+{
+	if (strcmp(mode_str, "blocking") == 0) {
+		recv_mode = RECV_BLOCKING;
+	} else if (strcmp(mode_str, "epoll") == 0) {
+		recv_mode = RECV_EPOLL;
+	} else if (strcmp(mode_str, "busy") == 0) {
+		recv_mode = RECV_BUSY;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int recv_mode_setup(int fd)
+{
+	if (recv_mode == RECV_EPOLL) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.fd = fd,
+		};
+		recv_epfd = epoll_create1(0);
+		if (recv_epfd < 0) {
+			perror("epoll_create1");
+			return -1;
+		}
+		if (epoll_ctl(recv_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	} else if (recv_mode == RECV_BUSY) {
+		// Not all transports (or unprivileged users) get busy polling in
+		// the kernel, the MSG_DONTWAIT spin works regardless.
+		int usec = BUSY_POLL_USEC;
+		if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) != 0) {
+			DEBUG_PRINT("SO_BUSY_POLL unavailable: %s\n", strerror(errno));
+		}
+	}
+	return 0;
+}
+
+int socket_wait(int fd)
+{
+	struct epoll_event ev;
+	char c;
+
+	switch (recv_mode) {
+	case RECV_EPOLL:
+		while (epoll_wait(recv_epfd, &ev, 1, -1) < 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+		}
+		break;
+	case RECV_BUSY:
+		while (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EINTR)) {
+			cpu_relax();
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+ssize_t socket_recv(int fd, void *buf, size_t len)
+{
+	if (recv_mode == RECV_BLOCKING) {
+		return read(fd, buf, len);
+	}
+
+	for (;;) {
+		ssize_t nbytes = recv(fd, buf, len, MSG_DONTWAIT);
+		if (nbytes >= 0 || (errno != EAGAIN && errno != EINTR)) {
+			return nbytes;
+		}
+		if (recv_mode == RECV_EPOLL) {
+			if (socket_wait(fd) != 0) {
+				return -1;
+			}
+		} else {
+			cpu_relax();
+		}
+	}
+}
+
+ssize_t socket_send(int fd, const void *buf, size_t len)
+{
+	return write(fd, buf, len);
+}
+
+const struct transport_ops *transport = &vsock_transport;
+
+__thread unsigned long n_read_calls;
+
+int recv_wait(int fd)
+{
+	return transport->wait(fd);
+}
+
+ssize_t recv_some(int fd, void *buf, size_t len)
+{
+	n_read_calls++;
+	return transport->recv(fd, buf, len);
+}
+
+int read_full(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	while (len > 0) {
+		ssize_t nbytes = recv_some(fd, ptr, len);
+		if (nbytes < 0 && errno == EINTR) {
+			continue;
+		} else if (nbytes <= 0) {
+			return -1;
+		}
+		ptr += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	while (len > 0) {
+		ssize_t nbytes = transport->send(fd, ptr, len);
+		if (nbytes < 0 && errno == EINTR) {
+			continue;
+		} else if (nbytes <= 0) {
+			return -1;
+		}
+		ptr += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+int listen_and_accept_single_client_connection(const struct transport_ops *ops, struct peer_id *peer)
+{
+	if (ops->listen_and_accept) {
+		return ops->listen_and_accept(peer);
+	}
+
+	int listen_fd = ops->listen(1);
+	if (listen_fd < 0) {
+		return -1;
+	}
+
+	int client_fd = ops->accept(listen_fd, peer);
+	close(listen_fd);
+	return client_fd;
+}
+
+const struct transport_ops vsock_transport = {
+	.name = "vsock",
+	.listen = vsock_listen_socket,
+	.accept = vsock_accept_client,
+	.connect = vsock_connect,
+	.wait = socket_wait,
+	.recv = socket_recv,
+	.send = socket_send,
+	.is_socket = true,
+};
+
+const struct transport_ops unix_transport = {
+	.name = "unix",
+	.listen = unix_listen_socket,
+	.accept = unix_accept_client,
+	.connect = unix_connect,
+	.wait = socket_wait,
+	.recv = socket_recv,
+	.send = socket_send,
+	.is_socket = true,
+};
+
+const struct transport_ops inet_transport = {
+	.name = "inet",
+	.listen = inet_listen_socket,
+	.accept = inet_accept_client,
+	.connect = inet_connect,
+	.wait = socket_wait,
+	.recv = socket_recv,
+	.send = socket_send,
+	.is_socket = true,
+};
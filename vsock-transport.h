@@ -0,0 +1,127 @@
+/**
+ * vsock-transport.h
+ *
+ * The transports shared by the benchmarks: setting up vsock, unix and inet
+ * connections, and the reads and writes their timing loops do over them
+ * (in any --recv-mode), behind one ops table so that a new transport or
+ * receive strategy gets measured by every tool the same way.
+ */
+
+#ifndef VSOCK_TRANSPORT_H
+#define VSOCK_TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef DEBUG
+#define DEBUG_PRINT(...) do{ fprintf( stderr, __VA_ARGS__ ); } while( false )
+#else
+#define DEBUG_PRINT(...) do{ } while ( false )
+#endif
+
+#define SERVER_LISTEN_PORT 12345
+
+// vsock/inet port (-p), and SOCK_STREAM or SOCK_SEQPACKET (vsock and unix,
+// see --sock-type) for the sockets set up below.
+extern int port;
+extern int sock_type;
+
+// Where the unix server listens, which differs per tool.
+extern const char *server_unix_path;
+
+// Leave out the "Connection from ..." line, for servers accepting many.
+extern bool quiet_accept;
+
+// Called on each new vsock socket before bind() or connect(), for options
+// of the caller's own (eg: nc-vsock's buffer sizes), if set.
+extern void (*vsock_socket_setup)(int fd);
+
+// Who is on the other end of a server connection.  Clients with the same
+// name (eg: several from one VM) are reported together by the multi-client
+// server.
+struct peer_id
+{
+	char name[64];
+	unsigned int cid;	// vsock only
+	int host_vm_id;		// vsock transports that know it, else -1
+};
+
+int parse_cid(const char *cid_str);
+int parse_sock_type(const char *type_str);
+
+// What vsock_transport's listen() and connect() do on the -p port, for
+// callers with ports of their own.  flags go to socket(), with
+// SOCK_NONBLOCK the connect() may still be in progress on return.
+int vsock_listen_port(unsigned int listen_port, int backlog);
+int vsock_connect_port(unsigned int cid, unsigned int server_port, int flags);
+
+// How reads wait for data, see --recv-mode.  Blocking reads pay for a
+// scheduler wakeup on every message, epoll pays for it too but lets the
+// server start its timer once data is there, and busy spins on the socket
+// from a dedicated core so neither side ever sleeps.
+enum recv_mode
+{
+	RECV_BLOCKING,
+	RECV_EPOLL,
+	RECV_BUSY,
+};
+
+extern enum recv_mode recv_mode;
+extern __thread int recv_epfd;
+
+int parse_recv_mode(const char *mode_str);
+// Prepares a connected socket for reads in recv_mode.
+int recv_mode_setup(int fd);
+
+/*
+ * A transport.  The sockets set up their connections with listen(),
+ * accept() and connect(), baselines that don't have a listening socket
+ * (eg: a shared memory ring) pair up with listen_and_accept() instead.
+ * Either way the timing loops then do their I/O through wait(), recv() and
+ * send().  Connections that aren't sockets only ever come one at a time,
+ * so their state can be global, with the fd just what wait() and recv()
+ * read from.
+ */
+struct transport_ops
+{
+	const char *name;
+	// The server's listening socket, then one client from it.
+	int (*listen)(int backlog);
+	int (*accept)(int listen_fd, struct peer_id *peer);
+	// server_arg as given to -c: a cid, a path or an ip address.
+	int (*connect)(const char *server_arg);
+	int (*listen_and_accept)(struct peer_id *peer);
+	// Returns once fd has data to read (or an error/EOF to report).
+	int (*wait)(int fd);
+	// Like read()/write() in recv_mode: some bytes, 0 at EOF or -1.
+	ssize_t (*recv)(int fd, void *buf, size_t len);
+	ssize_t (*send)(int fd, const void *buf, size_t len);
+	// writev()/sendmmsg() batches and multiple connections need an fd.
+	bool is_socket;
+};
+
+extern const struct transport_ops vsock_transport;
+extern const struct transport_ops unix_transport;
+extern const struct transport_ops inet_transport;
+
+// What recv_wait(), recv_some(), read_full() and write_full() go through.
+extern const struct transport_ops *transport;
+
+// Sets up the server's one client connection over ops.
+int listen_and_accept_single_client_connection(const struct transport_ops *ops, struct peer_id *peer);
+
+int socket_wait(int fd);
+ssize_t socket_recv(int fd, void *buf, size_t len);
+ssize_t socket_send(int fd, const void *buf, size_t len);
+
+// recv_some() calls, for the batch stats.
+extern __thread unsigned long n_read_calls;
+
+int recv_wait(int fd);
+// read() in recv_mode.
+ssize_t recv_some(int fd, void *buf, size_t len);
+int read_full(int fd, void *buf, size_t len);
+int write_full(int fd, const void *buf, size_t len);
+
+#endif /* VSOCK_TRANSPORT_H */